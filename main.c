@@ -1,17 +1,32 @@
 
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
 
+#ifndef HEADLESS
 #define GL_GLEXT_PROTOTYPES
 #include <SDL/SDL.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <png.h>
+#endif
+
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 static const int TEXTURE_SIZE = 32;
@@ -26,6 +41,14 @@ static const int ACTOR_STEP = 300;
 static const int ACTOR_FOV = 180;
 
 
+typedef enum {
+  SEARCH_A_STAR,
+  SEARCH_JPS,
+} PathSearch;
+
+static const PathSearch PATH_SEARCH = SEARCH_JPS;
+
+
 // Tile coordinate to pixel coordinate (center of tile)
 int pc (const int tile_coord) {
   return tile_coord * TILE_SIZE + TILE_SIZE / 2;
@@ -90,19 +113,20 @@ bool bresenham (int x0, int y0, int x1, int y1, bool (*callback) (int, int, cons
 }
 
 
+typedef struct Point_ {
+  int x;
+  int y;
+  struct Point_* next;
+} Point;
+
 
 typedef struct {
   int x;
   int y;
   int angle;
   int radius;
-  int base_x;
-  int base_y;
-  int base_angle;
-  int tx;
-  int ty;
-  int t_angle;
-  int give_up_at;
+  int prev_x;       // Position before the last step, for interpolation
+  int prev_y;
 } Actor;
 
 
@@ -111,16 +135,42 @@ void init_actor (Actor* actor, int x, int y, int angle, int radius) {
   actor->y = y;
   actor->angle = angle;
   actor->radius = radius;
-  actor->base_x = x;
-  actor->base_y = y;
-  actor->base_angle = angle;
-  actor->tx = -1;
-  actor->ty = -1;
-  actor->t_angle = -1;
-  actor->give_up_at = -1;
+  actor->prev_x = x;
+  actor->prev_y = y;
 }
 
 
+// AI state of an actor, only touched when the actor thinks
+typedef struct {
+  int base_x;
+  int base_y;
+  int base_angle;
+  int tx;
+  int ty;
+  int t_angle;
+  int give_up_at;
+  Point* path;      // Cached path, starting from the tile last walked on
+  int path_gx;
+  int path_gy;
+  unsigned int path_version;
+} ActorMind;
+
+
+// Actors other than the player as parallel arrays, so that loops over
+// positions run over contiguous memory. Indexed the same way throughout.
+typedef struct {
+  int len;
+  int max;
+  int* x;
+  int* y;
+  int* angle;
+  int* radius;
+  int* prev_x;
+  int* prev_y;
+  ActorMind* minds;
+} ActorList;
+
+
 typedef enum {
   FORWARD = 0,
   BACKWARD,
@@ -132,601 +182,874 @@ typedef enum {
 const int ACTION_COUNT = NOP + 1;
 
 
-typedef struct Tile_ Tile;
-struct Tile_ {
-  int code;
-  bool active;
+typedef struct {
+  char symbol;
+  int code;            // Texture index, the next one is used when active
   int activation_time; // -1 means cannot be activated, 0 means instant
-  int flips_in;
-  bool occupied;
-  bool (*passable) (const Tile*);
-  bool (*see_through) (const Tile*);
-  bool (*activatable) (const Tile*);
+  bool passable[2];    // Indexed by active
+  bool see_through[2];
+  bool needs_vacancy;  // Cannot be activated while occupied
+} TileType;
+
+
+static const TileType TILE_TYPES[] = {
+  { ' ', 0, -1, { true, true }, { true, true }, false },
+  { '#', 1, -1, { false, false }, { false, false }, false },
+  { '+', 2, 10, { false, true }, { false, true }, true },
 };
+static const int TILE_TYPE_COUNT = sizeof(TILE_TYPES) / sizeof(TILE_TYPES[0]);
+static const int TILE_WALL = 1;
+
+
+typedef struct {
+  int key;
+  int value;
+} HeapNode;
+
+
+// Binary min-heap on key
+typedef struct {
+  HeapNode* nodes;
+  int len;
+  int max;
+} Heap;
+
+
+typedef struct PathScratch_ PathScratch;
+typedef struct FlowCache_ FlowCache;
+typedef struct LosCache_ LosCache;
 
 
 typedef struct {
   int width;
   int height;
-  Tile* tiles;
+  const uint8_t* types; // Type code of every tile
+  void* types_block; // Allocation or file mapping that holds types
+  size_t types_size;
+  bool types_mapped;
+  // Per-tile flags, indexed like types
+  uint32_t* passable_bits;
+  uint32_t* see_through_bits;
+  uint32_t* occupied_bits;
+  uint32_t* active_bits;
+  uint32_t* flipping_bits; // Set while a flip is pending
+  uint8_t* neighbor_masks; // Bit i set if NEIGHBOR_OFFSETS[i] can be stepped to
+  int* occupied; // Indices of the tiles set in occupied_bits
+  int occupied_len;
+  int occupied_max;
+  int tick; // Number of check_tiles() calls so far
+  Heap flips; // Pending flips keyed on tick
+  unsigned int version; // Bumped whenever passability changes
+  FlowCache* flow;
+  LosCache* los;
 } Level;
 
 
+#define LOG_DEBUG 0
+#define LOG_ERROR 1
+#define LOG_NONE 2
+
+// Messages below this level compile to nothing, e.g. -DLOG_LEVEL=LOG_ERROR
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+
 typedef enum {
-  DEBUG,
-  ERROR
+  DEBUG = LOG_DEBUG,
+  ERROR = LOG_ERROR
 } LogLevel;
 
 
+// Formatted messages wait here until flush_log(), so no thread ever blocks
+// on stderr. Producers claim a slot with a CAS on head; each slot's turn
+// says whether it is free or filled for the current lap around the ring.
+#define LOG_SLOTS 256
+#define LOG_MESSAGE 256
+
+typedef struct {
+  unsigned turn;
+  char text[LOG_MESSAGE];
+} LogSlot;
+
+typedef struct {
+  LogSlot slots[LOG_SLOTS];
+  unsigned head;
+  unsigned tail;
+  unsigned dropped;
+} LogRing;
+
+static LogRing log_ring;
+
+
+// Turn of a slot that is free for position pos; pos's message is in it
+// once the turn is one higher
+unsigned log_turn (const unsigned pos) {
+  return pos / LOG_SLOTS * 2;
+}
+
+
 void actual_log (const LogLevel level, const char* file, const int line,
     const char* func, const char* fmt, ...) {
+  unsigned pos;
+  LogSlot* slot;
+  for (;;) {
+    pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+    slot = &log_ring.slots[pos % LOG_SLOTS];
+    if (__atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE) == log_turn(pos)) {
+      if (__sync_bool_compare_and_swap(&log_ring.head, pos, pos + 1)) {
+        break;
+      }
+    }
+    else if (__atomic_load_n(&log_ring.head, __ATOMIC_RELAXED) == pos) {
+      // Full until the next flush
+      __sync_fetch_and_add(&log_ring.dropped, 1);
+      return;
+    }
+  }
+
   va_list ap;
   va_start(ap, fmt);
 
-  fprintf(stderr, "[%d, %s:%d %s] ", level, file, line, func);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  const int n = snprintf(slot->text, LOG_MESSAGE, "[%d, %s:%d %s] ", level, file, line, func);
+  if (n >= 0 && n < LOG_MESSAGE) {
+    vsnprintf(slot->text + n, LOG_MESSAGE - n, fmt, ap);
+  }
 
   va_end(ap);
+
+  __atomic_store_n(&slot->turn, log_turn(pos) + 1, __ATOMIC_RELEASE);
+}
+
+
+// Writes out queued messages. Only one thread may flush at a time; the
+// main loops do it at the end of each frame.
+void flush_log (void) {
+  for (;;) {
+    const unsigned pos = log_ring.tail;
+    LogSlot* const slot = &log_ring.slots[pos % LOG_SLOTS];
+    if (__atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE) != log_turn(pos) + 1) {
+      break;
+    }
+    fprintf(stderr, "%s\n", slot->text);
+    __atomic_store_n(&slot->turn, log_turn(pos + LOG_SLOTS), __ATOMIC_RELEASE);
+    log_ring.tail = pos + 1;
+  }
+
+  const unsigned dropped = __sync_fetch_and_and(&log_ring.dropped, 0);
+  if (dropped > 0) {
+    fprintf(stderr, "[log ring full, dropped %u messages]\n", dropped);
+  }
 }
 
 #define macro_log(level,fmt,...) actual_log(level, __FILE__, __LINE__, __func__, fmt, __VA_ARGS__)
 
+// Disabled levels still type-check their arguments but emit no code
+#define no_log(level,fmt,...) do { if (0) macro_log(level, fmt, __VA_ARGS__); } while (0)
+
+#if LOG_LEVEL <= LOG_ERROR
 #define log_e(fmt,...) macro_log(ERROR, fmt, __VA_ARGS__)
-#define log_d(fmt,...) macro_log(DEBUG, fmt, __VA_ARGS__)
+#else
+#define log_e(fmt,...) no_log(ERROR, fmt, __VA_ARGS__)
+#endif
 
+#if LOG_LEVEL <= LOG_DEBUG
+#define log_d(fmt,...) macro_log(DEBUG, fmt, __VA_ARGS__)
+#else
+#define log_d(fmt,...) no_log(DEBUG, fmt, __VA_ARGS__)
+#endif
 
-bool tile_always (const Tile* tile) {
-  return true;
-}
 
-bool tile_never (const Tile* tile) {
-  return false;
-}
+// Time spent in each subsystem, summed over all frames
+typedef enum {
+  TIMER_GAME,
+  TIMER_PATHS,
+  TIMER_LOS,
+  TIMER_COLLISION,
+  TIMER_TILES,
+  TIMER_SIGHT,
+  TIMER_DRAW,
+  TIMER_COUNT
+} TimerId;
+
+static const char* const TIMER_NAMES[] = {
+  [TIMER_GAME] = "game",
+  [TIMER_PATHS] = "paths",
+  [TIMER_LOS] = "los",
+  [TIMER_COLLISION] = "collision",
+  [TIMER_TILES] = "tiles",
+  [TIMER_SIGHT] = "sight",
+  [TIMER_DRAW] = "draw",
+};
 
-bool tile_if_active (const Tile* tile) {
-  return tile->active;
-}
+typedef struct {
+  int64_t ns;
+  int calls;
+} Timer;
 
-bool tile_if_not_occupied (const Tile* tile) {
-  return !tile->occupied;
-}
+static Timer timers[TIMER_COUNT];
 
 
-Tile* tile_at (const Level* const level, const int x, const int y) {
-  assert(x >= 0);
-  assert(x < level->width);
-  assert(y >= 0);
-  assert(y < level->height);
-  return &level->tiles[y * level->width + x];
+int64_t clock_ns (void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
 
-bool passable (const Level* const level, const int x, const int y) {
-  const Tile* tile = tile_at(level, x, y);
-  return tile->passable(tile);
+// Timers and counters are shared by the AI workers, hence the atomic adds
+void timer_stop (const TimerId id, const int64_t started) {
+  __sync_fetch_and_add(&timers[id].ns, clock_ns() - started);
+  __sync_fetch_and_add(&timers[id].calls, 1);
 }
 
 
-bool see_through (const Level* const level, const int x, const int y) {
-  const Tile* tile = tile_at(level, x, y);
-  return tile->see_through(tile);
-}
+// Work done, summed over all frames
+typedef enum {
+  COUNTER_NODES,      // Expanded by path searches and flow fields
+  COUNTER_RAYS,       // Line of sight rays traced
+  COUNTER_COLLISION_ITERATIONS,
+  COUNTER_COLLISION_UNSETTLED,   // Bodies still moving when settling gave up
+  COUNTER_COLLISION_LEVEL_TESTS, // Bodies tested against the level
+  COUNTER_COLLISION_PAIR_TESTS,  // Pairs of bodies tested against each other
+  COUNTER_DRAW_CALLS,
+  COUNTER_MARK_OVERFLOWS,
+  COUNTER_ACTORS_ASLEEP,
+  COUNTER_COUNT
+} CounterId;
+
+static const char* const COUNTER_NAMES[] = {
+  [COUNTER_NODES] = "nodes",
+  [COUNTER_RAYS] = "rays",
+  [COUNTER_COLLISION_ITERATIONS] = "collision_iterations",
+  [COUNTER_COLLISION_UNSETTLED] = "collision_unsettled",
+  [COUNTER_COLLISION_LEVEL_TESTS] = "collision_level_tests",
+  [COUNTER_COLLISION_PAIR_TESTS] = "collision_pair_tests",
+  [COUNTER_DRAW_CALLS] = "draw_calls",
+  [COUNTER_MARK_OVERFLOWS] = "mark_overflows",
+  [COUNTER_ACTORS_ASLEEP] = "actors_asleep",
+};
 
+static int64_t counters[COUNTER_COUNT];
 
-bool can_be_activated (const Level* const level, const int x, const int y) {
-  const Tile* tile = tile_at(level, x, y);
-  return tile->activation_time >= 0 && tile->flips_in < 0 && tile->activatable(tile);
+
+void counter_add (const CounterId id, const int n) {
+  __sync_fetch_and_add(&counters[id], n);
 }
 
 
-bool load_level (const char* filename, Level* level) {
-  FILE* file = fopen(filename, "r");
-  if (file == NULL) {
-    log_e("Could not open %s: %s", filename, strerror(errno));
-    return false;
-  }
+#define PROFILE_FRAMES 60
 
-  log_d("Loading level %s...", filename);
+typedef struct {
+  int64_t ns[TIMER_COUNT];
+  int64_t counts[COUNTER_COUNT];
+} ProfileSample;
 
-  int width = 0;
-  while (!feof(file) && fgetc(file) != '\n') {
-    ++width;
-  }
 
-  int height = 1;
-  while (!feof(file)) {
-    if (fgetc(file) == '\n') {
-      ++height;
+// Per frame timers and counters over the last PROFILE_FRAMES frames,
+// optionally written out as CSV rows
+typedef struct {
+  ProfileSample history[PROFILE_FRAMES];
+  ProfileSample sum;  // Of history
+  ProfileSample last; // Totals when the previous frame ended
+  int frames;
+  FILE* csv;
+} Profile;
+
+
+void init_profile (Profile* const profile, FILE* const csv) {
+  memset(profile, 0, sizeof(Profile));
+  profile->csv = csv;
+
+  if (csv != NULL) {
+    fprintf(csv, "frame");
+    for (int t = 0; t < TIMER_COUNT; ++t) {
+      fprintf(csv, ",%s_ms", TIMER_NAMES[t]);
+    }
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+      fprintf(csv, ",%s", COUNTER_NAMES[c]);
     }
+    fprintf(csv, "\n");
   }
+}
 
-  rewind(file);
-
-  log_d("Level dimensions: %d x %d", width, height);
 
-  level->width = width;
-  level->height = height;
+void end_profile_frame (Profile* const profile) {
+  ProfileSample* const sample = &profile->history[profile->frames % PROFILE_FRAMES];
 
-  level->tiles = calloc(width * height, sizeof(Tile));
-  if (!level->tiles) { 
-    log_e("Memory allocation failed: %s", strerror(errno));
-    return false;
+  for (int t = 0; t < TIMER_COUNT; ++t) {
+    profile->sum.ns[t] -= sample->ns[t];
+    sample->ns[t] = timers[t].ns - profile->last.ns[t];
+    profile->sum.ns[t] += sample->ns[t];
+    profile->last.ns[t] = timers[t].ns;
+  }
+  for (int c = 0; c < COUNTER_COUNT; ++c) {
+    profile->sum.counts[c] -= sample->counts[c];
+    sample->counts[c] = counters[c] - profile->last.counts[c];
+    profile->sum.counts[c] += sample->counts[c];
+    profile->last.counts[c] = counters[c];
   }
 
-  int i = 0;
-  while (!feof(file)) {
-    char c = fgetc(file);
-    if (c == '\n' || c == EOF) {
-      continue;
+  if (profile->csv != NULL) {
+    fprintf(profile->csv, "%d", profile->frames);
+    for (int t = 0; t < TIMER_COUNT; ++t) {
+      fprintf(profile->csv, ",%.3f", sample->ns[t] / 1e6);
     }
-
-    Tile* t = &level->tiles[i++];
-
-    t->code = 0;
-    t->active = false;
-    t->activation_time = -1;
-    t->flips_in = -1;
-    t->passable = tile_never;
-    t->see_through = tile_never;
-    t->activatable = tile_never;
-
-    switch (c) {
-      case ' ':
-        t->passable = tile_always;
-        t->see_through = tile_always;
-        break;
-
-      case '#':
-        t->code = 1;
-        break;
-
-      case '+':
-        t->code = 2;
-        t->activation_time = 10;
-        t->passable = tile_if_active;
-        t->see_through = tile_if_active;
-        t->activatable = tile_if_not_occupied;
-        break;
-
-      default:
-        log_e("Invalid tile: '%c'", c);
-        break;
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+      fprintf(profile->csv, ",%lld", (long long)sample->counts[c]);
     }
+    fprintf(profile->csv, "\n");
   }
 
-  return true;
+  ++profile->frames;
 }
 
 
-void free_level (Level level) {
-  free(level.tiles);
+double profile_ms (const Profile* profile, const TimerId id) {
+  const int n = profile->frames < PROFILE_FRAMES ? profile->frames : PROFILE_FRAMES;
+  return n > 0 ? profile->sum.ns[id] / 1e6 / n : 0;
 }
 
 
-int d (int x1, int y1, int x2, int y2) {
-  return round(sqrt(pow(x2 - x1, 2) + pow(y2 - y1, 2)));
+double profile_count (const Profile* profile, const CounterId id) {
+  const int n = profile->frames < PROFILE_FRAMES ? profile->frames : PROFILE_FRAMES;
+  return n > 0 ? (double)profile->sum.counts[id] / n : 0;
 }
 
 
-void turn (Actor* const actor, int degrees) {
-  degrees += actor->angle;
-  degrees %= 360;
-  if (degrees < 0) {
-    degrees = 360 + degrees;
-  }
+#define MAX_WORKERS 16
+
+typedef void (*Job) (void* data, int worker, int item);
 
-  assert(degrees >= 0);
-  assert(degrees < 360);
 
-  actor->angle = degrees;
+typedef struct {
+  struct WorkerPool_* pool;
+  int worker;
+} WorkerArg;
+
+
+// Threads that run a job over a range of items. The caller works too, as
+// worker 0. Items are handed out in chunks from a shared counter, so
+// whoever finishes early takes more.
+typedef struct WorkerPool_ {
+  int count;          // Workers including the caller
+  pthread_t threads[MAX_WORKERS];
+  WorkerArg args[MAX_WORKERS];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  unsigned int round; // Bumped for each run
+  int running;        // Threads still working on the current round
+  bool quit;
+  Job job;
+  void* data;
+  int items;
+  int chunk;
+  int next;           // First item not yet handed out
+} WorkerPool;
+
+
+void work (WorkerPool* const pool, const int worker) {
+  for (;;) {
+    const int first = __sync_fetch_and_add(&pool->next, pool->chunk);
+    if (first >= pool->items) {
+      break;
+    }
+    const int last = first + pool->chunk < pool->items ? first + pool->chunk : pool->items;
+    for (int i = first; i < last; ++i) {
+      pool->job(pool->data, worker, i);
+    }
+  }
 }
 
 
-void move (Actor* const actor, const int step) {
-  double angle_rad = actor->angle / 180.0 * M_PI;
+void* worker_main (void* arg) {
+  WorkerPool* const pool = ((WorkerArg*)arg)->pool;
+  const int worker = ((WorkerArg*)arg)->worker;
+  unsigned int round = 0;
 
-  actor->x += step * cos(angle_rad);
-  actor->y -= step * sin(angle_rad);
-}
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->round == round) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    round = pool->round;
+    pthread_mutex_unlock(&pool->lock);
 
+    work(pool, worker);
 
-typedef enum {
-  MARK_TILE_PLAYER_ON,
-  MARK_TILE_PLAYER_FACING,
-  MARK_DOT,
-  MARK_CAN_SEE,
-  MARK_ACTOR_SIGHT,
-  MARK_ACTOR_PATH,
-  MARK_ACTOR_SPOTTED,
-  MARK_ACTOR_CHASING,
-  MARK_ACTOR_LOST,
-} MarkReason;
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->idle);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
 
+  return NULL;
+}
 
-typedef struct {
-  MarkReason reason;
-  int x;
-  int y;
-} Mark;
 
+void free_worker_pool (WorkerPool* const pool) {
+  if (pool != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
 
-typedef struct {
-  Mark* marks;
-  int len;
-  int max_len;
-} MarkList;
+    for (int i = 1; i < pool->count; ++i) {
+      pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
+}
 
 
-void mark (MarkList* const list, MarkReason reason, int x, int y) {
-  if (list->len == list->max_len) {
-    log_e("Tile mark list already at maximum capacity: %d", list->max_len);
-    return;
+// Starts count - 1 threads, or one per online CPU if count is 0
+WorkerPool* new_worker_pool (int count) {
+  if (count <= 0) {
+    count = sysconf(_SC_NPROCESSORS_ONLN);
   }
+  count = clamp(count, 1, MAX_WORKERS);
 
-  Mark* const mark = &list->marks[list->len++];
-  mark->reason = reason;
-  mark->x = x;
-  mark->y = y;
-}
+  WorkerPool* const pool = calloc(1, sizeof(WorkerPool));
+  if (pool == NULL) {
+    log_e("Failed to allocate WorkerPool: %s", strerror(errno));
+    return NULL;
+  }
 
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  pool->count = 1;
+  for (int i = 1; i < count; ++i) {
+    pool->args[i].pool = pool;
+    pool->args[i].worker = i;
+    const int error = pthread_create(&pool->threads[i], NULL, worker_main, &pool->args[i]);
+    if (error != 0) {
+      log_e("Failed to start worker %d, going on with %d: %s", i, pool->count, strerror(error));
+      break;
+    }
+    ++pool->count;
+  }
 
-int sign (const double number) {
-  return (number > 0.0) - (number < 0.0);
+  return pool;
 }
 
 
-void check_corner (Actor* const player, const double angle, const int x, const int y) {
-  if (d(x, y, player->x, player->y) < player->radius) {
-    
-    player->x = x - player->radius * cos(angle);
-    player->y = y - player->radius * sin(angle);
+// Calls job for items 0 to items - 1 across the pool and returns once all
+// of them are done
+void run_parallel (WorkerPool* const pool, const int items, const int chunk, const Job job, void* const data) {
+  if (pool->count == 1 || items <= chunk) {
+    for (int i = 0; i < items; ++i) {
+      job(data, 0, i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->job = job;
+  pool->data = data;
+  pool->items = items;
+  pool->chunk = chunk;
+  pool->next = 0;
+  pool->running = pool->count - 1;
+  ++pool->round;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  work(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
   }
+  pthread_mutex_unlock(&pool->lock);
 }
 
 
-int find_voronoi (const int tx, const int ty, const int ax, const int ay) {
-  // Middle (really rare but can happen e.g. with doors
-  if (ax == pc(tx) && ay == pc(ty)) {
-    return 5;
+bool heap_push (Heap* const heap, const int key, const int value) {
+  if (heap->len == heap->max) {
+    const int max = heap->max > 0 ? heap->max * 2 : 64;
+    HeapNode* const nodes = realloc(heap->nodes, max * sizeof(HeapNode));
+    if (nodes == NULL) {
+      log_e("Failed to grow heap to %d nodes: %s", max, strerror(errno));
+      return false;
+    }
+    heap->nodes = nodes;
+    heap->max = max;
   }
 
-  const double left = pc_corner(tx);
-  const double right = left + TILE_SIZE;
-  const double top = pc_corner(ty);
-  const double bottom = top + TILE_SIZE;
+  int i = heap->len++;
+  while (i > 0) {
+    const int parent = (i - 1) / 2;
+    if (heap->nodes[parent].key <= key) {
+      break;
+    }
+    heap->nodes[i] = heap->nodes[parent];
+    i = parent;
+  }
 
-  const bool in_left = ax < left;
-  const bool in_top = ay < top;
-  const bool in_right = ax > right;
-  const bool in_bottom = ay > bottom;
+  heap->nodes[i].key = key;
+  heap->nodes[i].value = value;
+  return true;
+}
 
-  // Vertices
-  if (in_top && in_left) return 1;
-  else if (in_top && in_right) return 3;
-  else if (in_bottom && in_left) return 7;
-  else if (in_bottom && in_right) return 9;
 
-  // Edges (must check distance to center)
-  // NOTE: assume square tile
-  const int dx = ax - pc(tx);
-  const int dy = ay - pc(ty);
+HeapNode heap_pop (Heap* const heap) {
+  assert(heap->len > 0);
 
-  if (abs(dx) > abs(dy)) {
-    if (dx <= 0) {
-      return 4;
-    }
-    else {
-      return 6;
+  const HeapNode top = heap->nodes[0];
+  const HeapNode last = heap->nodes[--heap->len];
+
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= heap->len) {
+      break;
     }
-  }
-  else {
-    if (dy <= 0) {
-      return 2;
+    if (child + 1 < heap->len && heap->nodes[child + 1].key < heap->nodes[child].key) {
+      ++child;
     }
-    else {
-      return 8;
+    if (last.key <= heap->nodes[child].key) {
+      break;
     }
+    heap->nodes[i] = heap->nodes[child];
+    i = child;
   }
+  heap->nodes[i] = last;
+
+  return top;
 }
 
 
-double dot_product (double x1, double y1, double x2, double y2) {
-  return x1 * x2 + y1 * y2;
+void free_heap (Heap* const heap) {
+  free(heap->nodes);
+  heap->nodes = NULL;
+  heap->len = 0;
+  heap->max = 0;
 }
 
 
-double length (double x, double y) {
-  return sqrt(x*x + y*y);
+int bitset_words (const int bits) {
+  return (bits + 31) / 32;
 }
 
 
-typedef struct {
-  double x;
-  double y;
-} Vector;
-
+bool bit_get (const uint32_t* const bits, const int i) {
+  return (bits[i / 32] >> (i % 32)) & 1;
+}
 
-// dirx, diry: push direction unit vector
-// thwx, thwy: tile halfwidth vector
-// r: circle radius 
-// tp_len: tile-circle centerpoint distance
-Vector find_push (double dirx, double diry, double thwx, double thwy, double r, double tp_len) {
-  const double dp = dot_product(dirx, diry, thwx, thwy);
 
-  const double tprox = dp * dirx;
-  const double tproy = dp * diry;
+void bit_set (uint32_t* const bits, const int i) {
+  bits[i / 32] |= 1u << (i % 32);
+}
 
-  double push_len = r + dp - tp_len;
-  if (push_len < 0.0) {
-    push_len = 0.0;
-  }
 
-  Vector push = { dirx * push_len, diry * push_len };
-  return push;
+void bit_clear (uint32_t* const bits, const int i) {
+  bits[i / 32] &= ~(1u << (i % 32));
 }
 
 
-bool collide_actor_actor (Actor* a, Actor* b) {
-  double dx = b->x - a->x;
-  double dy = b->y - a->y;
-
-  if (abs(dx) < 0.1 && abs(dy) < 0.1) {
-    dx = 0.1;
+void bit_assign (uint32_t* const bits, const int i, const bool value) {
+  if (value) {
+    bit_set(bits, i);
+  }
+  else {
+    bit_clear(bits, i);
   }
+}
 
-  const double d_len = length(dx, dy);
-  const double overlap = a->radius + b->radius - d_len;
 
-  if (overlap > 0.0) {
-    const double push_x = 0.5 * overlap * dx / d_len;
-    const double push_y = 0.5 * overlap * dy / d_len;
+typedef struct {
+  unsigned int gen; // Node is unseen unless this matches PathScratch.gen
+  bool closed;
+  int g;
+  int f;
+  int from;
+} PathNode;
+
+
+// Search state reused across searches on one level
+struct PathScratch_ {
+  int size;
+  unsigned int gen;
+  PathNode* nodes;
+  Heap open;
+};
 
-    a->x -= round(push_x + 0.6 * sign(push_x));
-    a->y -= round(push_y + 0.5 * sign(push_y));
-    b->x += round(push_x + 0.4 * sign(push_x));
-    b->y += round(push_y + 0.5 * sign(push_y));
 
-    return true;
+PathScratch* new_path_scratch (const int size) {
+  PathScratch* const scratch = malloc(sizeof(PathScratch));
+  if (scratch == NULL) {
+    log_e("Failed to allocate PathScratch: %s", strerror(errno));
+    return NULL;
   }
 
-  return false;
-}
-
+  scratch->nodes = calloc(size, sizeof(PathNode));
+  if (scratch->nodes == NULL) {
+    log_e("Failed to allocate %d path nodes: %s", size, strerror(errno));
+    free(scratch);
+    return NULL;
+  }
 
-bool collide_level_actor (MarkList* const mark_list, const Level* const level, Actor* const actor) {
-  const int left = tc(actor->x - actor->radius);
-  const int right = tc(actor->x + actor->radius);
-  const int top = tc(actor->y - actor->radius);
-  const int bottom = tc(actor->y + actor->radius);
+  scratch->size = size;
+  scratch->gen = 0;
+  scratch->open.nodes = NULL;
+  scratch->open.len = 0;
+  scratch->open.max = 0;
 
-  const int tr = TILE_SIZE / 2;
+  return scratch;
+}
 
-  bool moved = false;
 
-  for (int y = top; y <= bottom; ++y) {
-    for (int x = left; x <= right; ++x) {
-      const int tcx = pc_corner(x);
-      const int tcy = pc_corner(y);
-
-      const int al = actor->x - actor->radius;
-      const int at = actor->y - actor->radius;
-      const int ar = actor->x + actor->radius;
-      const int ab = actor->y + actor->radius;
-
-      if (ar <= tcx) continue;
-      if (ab <= tcy) continue;
-      if (al >= tcx + TILE_SIZE) continue;
-      if (at >= tcy + TILE_SIZE) continue;
-
-      //mark(mark_list, MARK_TILE_PLAYER_ON, x, y);
-      if (!passable(level, x, y)) {
-        const double tpx = actor->x - pc(x);
-        const double tpy = actor->y - pc(y);
-
-        const double tp_len = length(tpx, tpy);
-
-        const double dirx = tpx / tp_len;
-        const double diry = tpy / tp_len;
-
-        Vector push = { 0.0, 0.0 };
-
-        const int voronoi = find_voronoi(x, y, actor->x, actor->y);
-        switch (voronoi) {
-          case 5:
-            log_e("WTF?!", 0);
-            push.x = 1;
-            break;
-
-          case 2:
-            push.y = tcy - ab;
-            assert(push.y < 0);
-            break;
-
-          case 4:
-            push.x = tcx - ar;
-            assert(push.x < 0);
-            break;
-
-          case 6:
-            push.x = tcx + TILE_SIZE - al;
-            assert(push.x > 0);
-            break;
-
-          case 8:
-            push.y = tcy + TILE_SIZE - at;
-            assert(push.y > 0);
-            break;
-
-          case 1:
-            push = find_push(dirx, diry, -tr, -tr, actor->radius, tp_len);
-            assert(push.x <= 0);
-            assert(push.y <= 0);
-            break;
-
-          case 3:
-            push = find_push(dirx, diry, tr, -tr, actor->radius, tp_len);
-            assert(push.x >= 0);
-            assert(push.y <= 0);
-            break;
-
-          case 7:
-            push = find_push(dirx, diry, -tr, tr, actor->radius, tp_len);
-            assert(push.x <= 0);
-            assert(push.y >= 0);
-            break;
-
-          case 9:
-            push = find_push(dirx, diry, tr, tr, actor->radius, tp_len);
-            assert(push.x >= 0);
-            assert(push.y >= 0);
-            break;
-        }
-        
-        const int ix = round(push.x + 0.5 * sign(push.x)); 
-        const int iy = round(push.y + 0.5 * sign(push.y));
-
-        if (ix != 0 || iy != 0) {
-          actor->x += ix;
-          actor->y += iy;
-          moved = true;
-        }
-      }
-    }
+void free_path_scratch (PathScratch* const scratch) {
+  if (scratch != NULL) {
+    free_heap(&scratch->open);
+    free(scratch->nodes);
+    free(scratch);
   }
-
-  return moved;
 }
 
 
-void check_tiles (const Level* const level) {
-  for (int i = 0; i < level->width * level->height; ++i) {
-    Tile* const tile = &level->tiles[i];
-    tile->occupied = false;
-    if (tile->flips_in > 0) {
-      --tile->flips_in;
-    }
-    else if (tile->flips_in == 0) {
-      tile->flips_in = -1;
-      tile->active = !tile->active;
-    }
+// Invalidates all nodes by bumping the generation
+void path_scratch_reset (PathScratch* const scratch) {
+  scratch->open.len = 0;
+  if (++scratch->gen == 0) {
+    memset(scratch->nodes, 0, scratch->size * sizeof(PathNode));
+    scratch->gen = 1;
   }
 }
 
 
-typedef struct Point_ {
-  int x;
-  int y;
-  struct Point_* next;
-} Point;
+#define FLOW_FIELD_COUNT 4
+static const int FLOW_UNREACHABLE = INT_MAX;
 
 
-Point* add_point (Point* head, int x, int y) {
-  Point* p = malloc(sizeof(Point));
-  p->x = x;
-  p->y = y;
-  p->next = head;
-  return p;
+// Distance from every tile to one goal tile
+typedef struct {
+  int goal; // -1 when unused
+  unsigned int version;
+  unsigned int used;
+  int* dist;
+} FlowField;
+
+
+struct FlowCache_ {
+  int size;
+  unsigned int clock;
+  FlowField fields[FLOW_FIELD_COUNT];
+};
+
+
+void free_flow_cache (FlowCache* const flow) {
+  if (flow != NULL) {
+    for (int i = 0; i < FLOW_FIELD_COUNT; ++i) {
+      free(flow->fields[i].dist);
+    }
+    free(flow);
+  }
 }
 
 
-Point* remove_point (Point* head, int x, int y) {
-  if (head == NULL) {
+FlowCache* new_flow_cache (const int size) {
+  FlowCache* const flow = calloc(1, sizeof(FlowCache));
+  if (flow == NULL) {
+    log_e("Failed to allocate FlowCache: %s", strerror(errno));
     return NULL;
   }
-  else if (head->x == x && head->y == y) {
-    Point* new_head = head->next;
-    free(head);
-    return new_head;
-  }
-  else {
-    for (Point* i = head; i->next != NULL; i = i->next) {
-      if (i->next->x == x && i->next->y == y) {
-        Point* new_next = i->next->next;
-        free(i->next);
-        i->next = new_next;
-        break;
-      }
-      
+
+  flow->size = size;
+  for (int i = 0; i < FLOW_FIELD_COUNT; ++i) {
+    flow->fields[i].goal = -1;
+    flow->fields[i].dist = malloc(size * sizeof(int));
+    if (flow->fields[i].dist == NULL) {
+      log_e("Failed to allocate flow field: %s", strerror(errno));
+      free_flow_cache(flow);
+      return NULL;
     }
-    return head;
   }
+
+  return flow;
 }
 
 
-bool has_point (Point* head, int x, int y) {
-  while (head != NULL) {
-    if (head->x == x && head->y == y) {
-      return true;
-    }
-    head = head->next;
+#define LOS_CACHE_SIZE 4096
+
+
+typedef struct {
+  int from; // Tile indices, -1 if unused
+  int to;
+  unsigned int version;
+  int ray; // Query tracing this pair in the current batch, -1 if none
+  bool visible;
+} LosEntry;
+
+
+typedef struct {
+  int from;
+  int to;
+  bool visible;
+} LosQuery;
+
+
+// Line of sight results by tile pair, valid while the level version is
+// unchanged, plus room for the batch being answered
+struct LosCache_ {
+  LosEntry entries[LOS_CACHE_SIZE];
+  LosQuery* queries;
+  int* rays;    // Queries to trace
+  int* sources; // Query with the same pair being traced, -1 if answered
+  int max;
+};
+
+
+LosCache* new_los_cache (void) {
+  LosCache* const los = malloc(sizeof(LosCache));
+  if (los == NULL) {
+    log_e("Failed to allocate LosCache: %s", strerror(errno));
+    return NULL;
   }
-  return false;
+
+  for (int i = 0; i < LOS_CACHE_SIZE; ++i) {
+    los->entries[i].from = -1;
+    los->entries[i].to = -1;
+    los->entries[i].ray = -1;
+  }
+  los->queries = NULL;
+  los->rays = NULL;
+  los->sources = NULL;
+  los->max = 0;
+
+  return los;
 }
 
 
-void free_point_list (Point* point) {
-  if (point != NULL) {
-    free_point_list(point->next);
-    free(point);
+void free_los_cache (LosCache* const los) {
+  if (los != NULL) {
+    free(los->queries);
+    free(los->rays);
+    free(los->sources);
+    free(los);
   }
 }
 
 
-Point* remove_last_point (Point* point) {
-  if (point == NULL) {
-    return NULL;
+int tile_index (const Level* const level, const int x, const int y) {
+  assert(x >= 0);
+  assert(x < level->width);
+  assert(y >= 0);
+  assert(y < level->height);
+  return y * level->width + x;
+}
+
+
+const TileType* tile_type (const Level* const level, const int x, const int y) {
+  return &TILE_TYPES[level->types[tile_index(level, x, y)]];
+}
+
+
+bool passable (const Level* const level, const int x, const int y) {
+  return bit_get(level->passable_bits, tile_index(level, x, y));
+}
+
+
+bool see_through (const Level* const level, const int x, const int y) {
+  return bit_get(level->see_through_bits, tile_index(level, x, y));
+}
+
+
+bool is_active (const Level* const level, const int x, const int y) {
+  return bit_get(level->active_bits, tile_index(level, x, y));
+}
+
+
+bool is_occupied (const Level* const level, const int x, const int y) {
+  return bit_get(level->occupied_bits, tile_index(level, x, y));
+}
+
+
+void set_occupied (Level* const level, const int x, const int y) {
+  const int i = tile_index(level, x, y);
+  if (bit_get(level->occupied_bits, i)) {
+    return;
   }
-  else {
-    Point* new_next = point->next;
-    free(point);
-    return point->next;
+
+  if (level->occupied_len == level->occupied_max) {
+    const int max = level->occupied_max > 0 ? level->occupied_max * 2 : 32;
+    int* const occupied = realloc(level->occupied, max * sizeof(int));
+    if (occupied == NULL) {
+      log_e("Failed to grow occupied list to %d: %s", max, strerror(errno));
+      return;
+    }
+    level->occupied = occupied;
+    level->occupied_max = max;
   }
+
+  level->occupied[level->occupied_len++] = i;
+  bit_set(level->occupied_bits, i);
 }
 
 
-int find_path_h (int x1, int y1, int x2, int y2) {
-  const int dx = x2 - x1;
-  const int dy = y2 - y1;
-  return dx*dx + dy*dy;
+// Sets the active flag of tile i along with the flags derived from it
+void set_active (const Level* const level, const int i, const bool active) {
+  const TileType* const type = &TILE_TYPES[level->types[i]];
+  bit_assign(level->active_bits, i, active);
+  bit_assign(level->passable_bits, i, type->passable[active]);
+  bit_assign(level->see_through_bits, i, type->see_through[active]);
 }
 
 
-Point* neighbors (const Level* level, int x, int y) {
-  bool p[8];
+bool can_be_activated (const Level* const level, const int x, const int y) {
+  const int i = tile_index(level, x, y);
+  const TileType* type = &TILE_TYPES[level->types[i]];
+  return type->activation_time >= 0 && !bit_get(level->flipping_bits, i) &&
+    !(type->needs_vacancy && is_occupied(level, x, y));
+}
 
-  // 4 0 5
-  // 1   2
-  // 6 3 7
-
-  struct {
-    int x;
-    int y;
-  } coords[8] = {
-    {  0, -1 },
-    { -1,  0 },
-    {  1,  0 },
-    {  0,  1 },
-
-    { -1, -1 },
-    {  1, -1 },
-    { -1,  1 },
-    {  1,  1 },
-  };
+
+typedef struct {
+  int x;
+  int y;
+  int cost;
+} Offset;
+
+
+// 4 0 5
+// 1   2
+// 6 3 7
+static const Offset NEIGHBOR_OFFSETS[8] = {
+  {  0, -1, 1 },
+  { -1,  0, 1 },
+  {  1,  0, 1 },
+  {  0,  1, 1 },
+
+  { -1, -1, 2 },
+  {  1, -1, 2 },
+  { -1,  1, 2 },
+  {  1,  1, 2 },
+};
+
+
+uint8_t compute_neighbor_mask (const Level* level, int x, int y) {
+  bool p[8];
 
   // Drop nonexistent tiles
   p[0] = y > 0;
   p[1] = x > 0;
-  p[2] = x < level->width;
-  p[3] = y < level->height;
-  p[4] = p[0] && p[1];
-  p[5] = p[0] && p[2];
-  p[6] = p[1] && p[3];
-  p[7] = p[2] && p[3];
+  p[2] = x < level->width - 1;
+  p[3] = y < level->height - 1;
 
   // Drop unpassable side tiles
   for (int i = 0; i < 4; ++i) {
-    p[i] = p[i] && passable(level, x + coords[i].x, y + coords[i].y);
+    p[i] = p[i] && passable(level, x + NEIGHBOR_OFFSETS[i].x, y + NEIGHBOR_OFFSETS[i].y);
   }
 
   // Drop corner tiles like X here:
@@ -748,623 +1071,3534 @@ Point* neighbors (const Level* level, int x, int y) {
 
   // Drop unpassable corner tiles
   for (int i = 4; i < 8; ++i) {
-    p[i] = p[i] && passable(level, x + coords[i].x, y + coords[i].y);
+    p[i] = p[i] && passable(level, x + NEIGHBOR_OFFSETS[i].x, y + NEIGHBOR_OFFSETS[i].y);
   }
 
-  // Make the final list
-  Point* n = NULL;
+  uint8_t mask = 0;
   for (int i = 0; i < 8; ++i) {
     if (p[i]) {
-      n = add_point(n, x + coords[i].x, y + coords[i].y);
+      mask |= 1 << i;
     }
   }
-
-  return n;
+  return mask;
 }
 
 
-bool dfs (const Level* level, Point** path, int x1, int y1, int x2, int y2) {
-  if (x1 >= 0 && y1 >= 0 && x1 < level->width && y1 < level->height &&
-      !has_point(*path, x1, y1) && passable(level, x1, y1)) {
-    *path = add_point(*path, x1, y1);
-
-    if (x1 == x2 && y1 == y2) {
-      return true;
-    }
-
-    Point* n = neighbors(level, x1, y1); 
-
-    while (n != NULL) {
-      Point* best = n;
-      int best_h = find_path_h(n->x, n->y, x2, y2);
-      for (Point* i = n->next; i != NULL; i = i->next) {
-        const int i_h = find_path_h(i->x, i->y, x2, y2);
-        if (i_h < best_h) {
-          best = i;
-          best_h = i_h;
-        }
-      }
+// Recomputes masks for tiles in the given rectangle, clamped to the level
+void update_neighbor_masks (const Level* level, int x1, int y1, int x2, int y2) {
+  x1 = clamp(x1, 0, level->width - 1);
+  x2 = clamp(x2, 0, level->width - 1);
+  y1 = clamp(y1, 0, level->height - 1);
+  y2 = clamp(y2, 0, level->height - 1);
 
-      if (dfs(level, path, best->x, best->y, x2, y2)) {
-        return true;
-      }
-      else {
-        n = remove_point(n, best->x, best->y);
-      }
+  for (int y = y1; y <= y2; ++y) {
+    for (int x = x1; x <= x2; ++x) {
+      level->neighbor_masks[y * level->width + x] = compute_neighbor_mask(level, x, y);
     }
-
-    *path = remove_last_point(*path);
   }
-
-  return false;
 }
 
 
-Point* a_star (const Level* level, int x1, int y1, int x2, int y2) {
-  Point* closed = NULL;
-  Point* open = add_point(NULL, x1, y1);
-  struct {
-    int g;
-    int f;
-    int from_x;
-    int from_y;
-  } data[level->width][level->height];
-
-  data[x1][y1].g = 0;
-  data[x1][y1].f = find_path_h(x1, y1, x2, y2);
-
-  while (open != NULL) {
-    Point* cur = open;
-    int min_f = data[open->x][open->y].f;
-    for (Point* i = open; i != NULL; i = i->next) {
-      const int f = data[i->x][i->y].f;
-      if (f < min_f) {
-        cur = i;
-        min_f = f;
-      }
-    }
-
-    const int cx = cur->x;
-    const int cy = cur->y;
-
-    if (cx == x2 && cy == y2) {
-      int x = cx;
-      int y = cy;
-      Point* path = add_point(NULL, x, y);
-      while (x != x1 || y != y1) {
-        path = add_point(path, data[x][y].from_x, data[x][y].from_y);
-        x = path->x;
-        y = path->y;
-      }
-
-      free_point_list(closed);
-      free_point_list(open);
+uint8_t neighbor_mask (const Level* level, int x, int y) {
+  return level->neighbor_masks[y * level->width + x];
+}
 
-      return path;
-    }
 
-    open = remove_point(open, cx, cy);
-    closed = add_point(closed, cx, cy);
+// Reallocates *array to max elements, leaving it as it was on failure
+bool grow_ints (int** const array, const int max) {
+  int* const grown = realloc(*array, max * sizeof(int));
+  if (grown == NULL) {
+    return false;
+  }
+  *array = grown;
+  return true;
+}
 
-    Point* n = neighbors(level, cx, cy);
-    for (Point* i = n; i != NULL; i = i->next) {
-      /* This check should be done by neighbors() */
-      /* if (!passable(level, i->x, i->y)) { */
-      /*   continue; */
-      /* } */
 
-      const int tg = data[cx][cy].g + find_path_h(cx, cy, i->x, i->y);
-      if (has_point(closed, i->x, i->y) && tg > data[i->x][i->y].g) {
-        continue;
-      }
+// Allocates a width x height level over one type code per tile, which
+// must already be valid. The level keeps pointing at types; the caller
+// hands over the block holding them after this succeeds.
+bool build_level (Level* level, const int width, const int height, const uint8_t* types) {
+  log_d("Level dimensions: %d x %d", width, height);
 
-      if (!has_point(open, i->x, i->y) || tg < data[i->x][i->y].g) {
-        data[i->x][i->y].from_x = cx;
-        data[i->x][i->y].from_y = cy;
-        data[i->x][i->y].g = tg;
-        data[i->x][i->y].f = tg + find_path_h(i->x, i->y, x2, y2);
-        if (!has_point(open, i->x, i->y)) {
-          open = add_point(open, i->x, i->y);
-        }
-      }
-    }
+  level->width = width;
+  level->height = height;
+  level->types = types;
+  level->types_block = NULL;
+  level->types_size = 0;
+  level->types_mapped = false;
+  level->version = 0;
+  level->tick = 0;
+  level->occupied = NULL;
+  level->occupied_len = 0;
+  level->occupied_max = 0;
+  level->flips.nodes = NULL;
+  level->flips.len = 0;
+  level->flips.max = 0;
+
+  const int words = bitset_words(width * height);
+  level->passable_bits = calloc(5 * words, sizeof(uint32_t));
+  if (!level->passable_bits) { 
+    log_e("Memory allocation failed: %s", strerror(errno));
+    return false;
   }
+  level->see_through_bits = level->passable_bits + words;
+  level->occupied_bits = level->see_through_bits + words;
+  level->active_bits = level->occupied_bits + words;
+  level->flipping_bits = level->active_bits + words;
 
-  free_point_list(open);
-  free_point_list(closed);
-
-  return NULL;
-}
-
+  for (int i = 0; i < width * height; ++i) {
+    set_active(level, i, false);
+  }
 
-Point* find_path (MarkList* mark_list, const Level* level, int x1, int y1, int x2, int y2) {
-  Point* path = NULL;
-  //dfs(level, &path, x1, y1, x2, y2);
-  path = a_star(level, x1, y1, x2, y2);
-  for (Point* i = path; i != NULL; i = i->next) {
-    mark(mark_list, MARK_ACTOR_PATH, i->x, i->y);
+  level->neighbor_masks = malloc(width * height);
+  if (!level->neighbor_masks) {
+    log_e("Memory allocation failed: %s", strerror(errno));
+    free(level->passable_bits);
+    return false;
   }
-  return path;
+  update_neighbor_masks(level, 0, 0, width - 1, height - 1);
+
+  level->flow = new_flow_cache(width * height);
+  level->los = new_los_cache();
+  if (!level->flow || !level->los) {
+    free_flow_cache(level->flow);
+    free_los_cache(level->los);
+    free(level->neighbor_masks);
+    free(level->passable_bits);
+    return false;
+  }
+
+  return true;
 }
 
 
+// Header of a precompiled level, followed by one type code per tile
 typedef struct {
-  Actor* actors;
-  int len;
-  int max;
-} ActorList;
-
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+} LevelHeader;
 
-bool line_of_sight_callback (int x, int y, const void* in, void* out) {
-  const Level* level = in;;
-  return see_through(level, x, y);
-}
+static const char LEVB_MAGIC[4] = { 'L', 'E', 'V', 'B' };
+static const uint32_t LEVB_VERSION = 1;
 
 
-bool mark_actor_sight_callback (int x, int y, const void* in, void* out) {
-  MarkList* mark_list = out;
-  mark(mark_list, MARK_ACTOR_SIGHT, x, y);
+bool valid_dimensions (const size_t width, const size_t height) {
+  if (width == 0 || height == 0 || width > INT_MAX / height) {
+    log_e("Invalid level dimensions: %zu x %zu", width, height);
+    return false;
+  }
   return true;
 }
 
 
-bool line_of_sight (MarkList* mark_list, const Level* level, int x1, int y1, int x2, int y2) {
-  if (bresenham(x1, y1, x2, y2, line_of_sight_callback, level, NULL)) {
-    //bresenham(x1, y1, x2, y2, mark_actor_sight_callback, NULL, mark_list);
-    return true;
-  }
-  else {
+bool parse_binary_level (const char* data, const size_t size, Level* level) {
+  LevelHeader header;
+  if (size < sizeof(header)) {
+    log_e("Truncated level header", 0);
     return false;
   }
-}
+  memcpy(&header, data, sizeof(header));
 
-
-int angle_dir (int angle) {
-  if (angle < -180) {
-    angle += 360;
+  if (header.version != LEVB_VERSION) {
+    log_e("Unsupported binary level version %u", (unsigned)header.version);
+    return false;
   }
-  else if (angle > 180) {
-    angle -= 360;
+  if (!valid_dimensions(header.width, header.height)) {
+    return false;
   }
-  return angle;
-}
 
+  const size_t area = (size_t)header.width * header.height;
+  if (size - sizeof(header) < area) {
+    log_e("Truncated level: %zu tiles for %u x %u", size - sizeof(header),
+        (unsigned)header.width, (unsigned)header.height);
+    return false;
+  }
 
-int angle_diff (int a, int b) {
-  return angle_dir(b - a);
+  // The tiles are used straight from the file mapping
+  const uint8_t* const types = (const uint8_t*)(data + sizeof(header));
+  for (size_t i = 0; i < area; ++i) {
+    if (types[i] >= TILE_TYPE_COUNT) {
+      log_e("Invalid tile type %d at %zu", types[i], i);
+      return false;
+    }
+  }
+
+  return build_level(level, header.width, header.height, types);
 }
 
 
-int angle_vector_diff (int angle, int dx, int dy) {
-  int angle_2 = atan2(-dy, dx) / M_PI * 180.0;
-  if (angle_2 < 0) {
-    angle_2 += 360;
+int tile_type_of (const char c) {
+  for (int type = 0; type < TILE_TYPE_COUNT; ++type) {
+    if (TILE_TYPES[type].symbol == c) {
+      return type;
+    }
   }
-  return angle_diff(angle, angle_2);
+  log_e("Invalid tile: '%c'", c);
+  return TILE_WALL;
 }
 
 
-bool seek_target (MarkList* mark_list, const Level* level, Actor* actor, int x, int y, int min_d) {
-  const int ax = actor->x;
-  const int ay = actor->y;
-
-  bool found = true;
-  Point* path = find_path(mark_list, level, tc(ax), tc(ay), tc(x), tc(y));
-  if (path != NULL) {
-    Point* target = path;
-    if (target->next != NULL) {
-      target = target->next;
-    }
-
-    const int nx = pc(target->x);
-    const int ny = pc(target->y);
+// Parses the text format in one pass. Rows may end in \n or \r\n; rows
+// shorter than the widest one are padded with walls and trailing blank
+// lines are ignored.
+bool parse_text_level (const char* data, const size_t size, Level* level) {
+  // There are never more tiles than bytes, so rows go straight into one
+  // buffer that only has to be re-laid out if they turn out ragged
+  uint8_t* types = malloc(size > 0 ? size : 1);
+  int* row_len = malloc(sizeof(int));
+  int max_rows = 1;
+  if (types == NULL || row_len == NULL) {
+    log_e("Memory allocation failed: %s", strerror(errno));
+    free(types);
+    free(row_len);
+    return false;
+  }
 
-    int diff = angle_vector_diff(actor->angle, nx - ax, ny - ay);
-    const int dist = d(ax, ay, x, y);
-    const int close = dist < min_d + ACTOR_STEP;
+  size_t len = 0;
+  int width = 0;
+  int height = 0;
+  int x = 0;
 
-    if (abs(diff) > 30) {
-      turn(actor, sign(diff) * 2 * ACTOR_TURN);
-      found = false;
+  for (size_t i = 0; i <= size; ++i) {
+    const char c = i < size ? data[i] : '\n';
+    if (c == '\r') {
+      continue;
     }
-    else if (abs(diff) > 10) {
-      turn(actor, sign(diff) * ACTOR_TURN);
-      found = false;
+    if (c != '\n') {
+      types[len++] = tile_type_of(c);
+      ++x;
+      continue;
     }
-    if (abs(diff) < 90 && !close) {
-      move(actor, ACTOR_STEP); 
-      found = false;
+    if (i == size && x == 0) {
+      break;
     }
-  }
-  free_point_list(path);
-  return found;
-}
 
+    if (height == max_rows && !grow_ints(&row_len, max_rows *= 2)) {
+      log_e("Memory allocation failed: %s", strerror(errno));
+      free(types);
+      free(row_len);
+      return false;
+    }
+    row_len[height++] = x;
+    if (x > width) {
+      width = x;
+    }
+    x = 0;
+  }
+
+  // Blank lines at the end are not rows
+  while (height > 0 && row_len[height - 1] == 0) {
+    --height;
+  }
+
+  if (!valid_dimensions(width, height)) {
+    free(types);
+    free(row_len);
+    return false;
+  }
+
+  int short_rows = 0;
+  for (int y = 0; y < height; ++y) {
+    short_rows += row_len[y] < width;
+  }
+
+  if (short_rows > 0) {
+    log_e("%d of %d rows are narrower than %d tiles, padding them with walls",
+        short_rows, height, width);
+
+    uint8_t* const padded = malloc(width * height);
+    if (padded == NULL) {
+      log_e("Memory allocation failed: %s", strerror(errno));
+      free(types);
+      free(row_len);
+      return false;
+    }
+    const uint8_t* from = types;
+    for (int y = 0; y < height; ++y) {
+      memcpy(&padded[y * width], from, row_len[y]);
+      memset(&padded[y * width + row_len[y]], TILE_WALL, width - row_len[y]);
+      from += row_len[y];
+    }
+    free(types);
+    types = padded;
+  }
+  free(row_len);
+
+  if (!build_level(level, width, height, types)) {
+    free(types);
+    return false;
+  }
+  level->types_block = types;
+  return true;
+}
+
+
+// Loads either format, telling them apart by the binary magic
+bool parse_level (const char* data, const size_t size, Level* level) {
+  if (size >= sizeof(LEVB_MAGIC) && memcmp(data, LEVB_MAGIC, sizeof(LEVB_MAGIC)) == 0) {
+    return parse_binary_level(data, size, level);
+  }
+  return parse_text_level(data, size, level);
+}
+
+
+bool read_level (FILE* file, Level* level) {
+  size_t size = 0;
+  size_t max = 4096;
+  char* data = malloc(max);
+  while (data != NULL) {
+    size += fread(data + size, 1, max - size, file);
+    if (size < max) {
+      break;
+    }
+    char* const grown = realloc(data, max *= 2);
+    if (grown == NULL) {
+      free(data);
+    }
+    data = grown;
+  }
+  if (data == NULL || ferror(file)) {
+    log_e("Failed to read level: %s", strerror(errno));
+    free(data);
+    return false;
+  }
+
+  const bool ok = parse_level(data, size, level);
+  if (ok && level->types_block == NULL) {
+    // A binary level's types point into data
+    level->types_block = data;
+  }
+  else {
+    free(data);
+  }
+  return ok;
+}
+
+
+bool load_level (const char* filename, Level* level) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    log_e("Could not open %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  log_d("Loading level %s...", filename);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    log_e("Could not stat %s: %s", filename, strerror(errno));
+    close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    log_e("%s is empty", filename);
+    close(fd);
+    return false;
+  }
+
+  void* const data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    log_e("Could not map %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  const bool ok = parse_level(data, st.st_size, level);
+  if (ok && level->types_block == NULL) {
+    // A binary level's types point into the mapping, which stays so that
+    // only the pages that get read are ever loaded from disk
+    level->types_block = data;
+    level->types_size = st.st_size;
+    level->types_mapped = true;
+  }
+  else {
+    munmap(data, st.st_size);
+  }
+  return ok;
+}
+
+
+bool save_binary_level (const char* filename, const Level* level) {
+  FILE* file = fopen(filename, "wb");
+  if (file == NULL) {
+    log_e("Could not open %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  LevelHeader header;
+  memcpy(header.magic, LEVB_MAGIC, sizeof(LEVB_MAGIC));
+  header.version = LEVB_VERSION;
+  header.width = level->width;
+  header.height = level->height;
+  const size_t area = (size_t)level->width * level->height;
+  const bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(level->types, 1, area, file) == area;
+
+  if (fclose(file) != 0 || !ok) {
+    log_e("Could not write %s: %s", filename, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+
+void free_level (Level level) {
+  free_flow_cache(level.flow);
+  free_los_cache(level.los);
+  free(level.neighbor_masks);
+  free(level.occupied);
+  free_heap(&level.flips);
+  free(level.passable_bits);
+  if (level.types_mapped) {
+    munmap(level.types_block, level.types_size);
+  }
+  else {
+    free(level.types_block);
+  }
+}
+
+
+int d (int x1, int y1, int x2, int y2) {
+  return round(sqrt(pow(x2 - x1, 2) + pow(y2 - y1, 2)));
+}
+
+
+void turn (int* const angle, int degrees) {
+  degrees += *angle;
+  degrees %= 360;
+  if (degrees < 0) {
+    degrees = 360 + degrees;
+  }
+
+  assert(degrees >= 0);
+  assert(degrees < 360);
+
+  *angle = degrees;
+}
+
+
+void move (int* const x, int* const y, const int angle, const int step) {
+  double angle_rad = angle / 180.0 * M_PI;
+
+  *x += step * cos(angle_rad);
+  *y -= step * sin(angle_rad);
+}
+
+
+typedef enum {
+  MARK_TILE_PLAYER_ON,
+  MARK_TILE_PLAYER_FACING,
+  MARK_DOT,
+  MARK_CAN_SEE,
+  MARK_ACTOR_SIGHT,
+  MARK_ACTOR_PATH,
+  MARK_ACTOR_SPOTTED,
+  MARK_ACTOR_CHASING,
+  MARK_ACTOR_LOST,
+} MarkReason;
+
+
+typedef struct {
+  MarkReason reason;
+  int x;
+  int y;
+} Mark;
+
+
+typedef struct {
+  Mark* marks;
+  int len;
+  int max_len;
+  int overflows; // Marks dropped since the last reset
+} MarkList;
+
+
+// Debug marks cost a store per path step and sight ray tile, so release
+// builds can compile them out with -DDEBUG_MARKS=0
+#ifndef DEBUG_MARKS
+#define DEBUG_MARKS 1
+#endif
+
+
+static const bool MARK_ENABLED[] = {
+  [MARK_TILE_PLAYER_ON] = DEBUG_MARKS,
+  [MARK_TILE_PLAYER_FACING] = true,
+  [MARK_DOT] = DEBUG_MARKS,
+  [MARK_CAN_SEE] = DEBUG_MARKS,
+  [MARK_ACTOR_SIGHT] = DEBUG_MARKS,
+  [MARK_ACTOR_PATH] = DEBUG_MARKS,
+  [MARK_ACTOR_SPOTTED] = true,
+  [MARK_ACTOR_CHASING] = true,
+  [MARK_ACTOR_LOST] = true,
+};
+
+
+// Upper bound on a list, so a runaway producer cannot eat all memory
+#define MARK_LIMIT (1 << 20)
+#define MARK_INITIAL 256
+
+
+void init_mark_list (MarkList* const list) {
+  list->marks = NULL;
+  list->len = 0;
+  list->max_len = 0;
+  list->overflows = 0;
+}
+
+
+void free_mark_list (MarkList* const list) {
+  free(list->marks);
+  init_mark_list(list);
+}
+
+
+// Starts a new frame, keeping the buffer. Dropped marks are reported once
+// here instead of once per mark.
+void reset_mark_list (MarkList* const list) {
+  if (list->overflows > 0) {
+    counter_add(COUNTER_MARK_OVERFLOWS, list->overflows);
+  }
+  list->len = 0;
+  list->overflows = 0;
+}
+
+
+bool reserve_mark_list (MarkList* const list, const int len) {
+  if (len <= list->max_len) {
+    return true;
+  }
+  if (len > MARK_LIMIT) {
+    return false;
+  }
+
+  int max_len = list->max_len > 0 ? list->max_len : MARK_INITIAL;
+  while (max_len < len) {
+    max_len *= 2;
+  }
+  max_len = clamp(max_len, len, MARK_LIMIT);
+
+  Mark* const marks = realloc(list->marks, max_len * sizeof(Mark));
+  if (marks == NULL) {
+    return false;
+  }
+  list->marks = marks;
+  list->max_len = max_len;
+  return true;
+}
+
+
+void mark (MarkList* const list, MarkReason reason, int x, int y) {
+  if (!MARK_ENABLED[reason]) {
+    return;
+  }
+  if (list->len == list->max_len && !reserve_mark_list(list, list->len + 1)) {
+    ++list->overflows;
+    return;
+  }
+
+  Mark* const mark = &list->marks[list->len++];
+  mark->reason = reason;
+  mark->x = x;
+  mark->y = y;
+}
+
+
+void append_marks (MarkList* const list, const MarkList* const from) {
+  int n = from->len;
+  if (!reserve_mark_list(list, list->len + n)) {
+    n = clamp(list->max_len - list->len, 0, n);
+  }
+  if (n > 0) {
+    memcpy(&list->marks[list->len], from->marks, n * sizeof(Mark));
+    list->len += n;
+  }
+  list->overflows += from->overflows + from->len - n;
+}
+
+
+int sign (const double number) {
+  return (number > 0.0) - (number < 0.0);
+}
+
+
+void check_corner (Actor* const player, const double angle, const int x, const int y) {
+  if (d(x, y, player->x, player->y) < player->radius) {
+    
+    player->x = x - player->radius * cos(angle);
+    player->y = y - player->radius * sin(angle);
+  }
+}
+
+
+// Collision works on integer world coordinates only, so that the same
+// inputs settle to the same positions on every machine
+
+int isign (const int number) {
+  return (number > 0) - (number < 0);
+}
+
+
+// Floor of the square root. The hardware square root is only a guess:
+// the integer checks pin the result down whatever the FPU rounding mode.
+uint32_t isqrt (const uint32_t n) {
+  uint64_t root = sqrt((double)n);
+  while (root * root > n) {
+    --root;
+  }
+  while ((root + 1) * (root + 1) <= n) {
+    ++root;
+  }
+  return root;
+}
+
+
+// Pushes bodies a and b apart, given as indices into the position arrays
+bool collide_actor_actor (int* const x, int* const y, const int* radius, const int a, const int b) {
+  int dx = x[b] - x[a];
+  const int dy = y[b] - y[a];
+
+  if (dx == 0 && dy == 0) {
+    dx = 1;
+  }
+
+  const int reach = radius[a] + radius[b];
+  const int64_t d2 = (int64_t)dx * dx + (int64_t)dy * dy;
+  if (d2 >= (int64_t)reach * reach) {
+    return false;
+  }
+
+  // d2 < reach^2, so it and the products below fit in 32 bits
+  const int d_len = isqrt(d2);
+  const int overlap = reach - d_len;
+
+  // Half the overlap each, one unit more so that they separate
+  const int px = overlap * dx / (2 * d_len);
+  const int py = overlap * dy / (2 * d_len);
+
+  x[a] -= px + isign(dx);
+  y[a] -= py + isign(dy);
+  x[b] += px + isign(dx);
+  y[b] += py + isign(dy);
+
+  return true;
+}
+
+
+// How far the body at (ax, ay) has to move to leave the wall tile whose
+// top left corner is (tx, ty). A body centered beside an edge is moved
+// straight out; one past a corner along the line from the corner.
+void tile_push (const int tx, const int ty, const int ax, const int ay, const int radius,
+    int* const push_x, int* const push_y) {
+  const int right = tx + TILE_SIZE;
+  const int bottom = ty + TILE_SIZE;
+  const bool in_left = ax < tx;
+  const bool in_right = ax > right;
+  const bool in_top = ay < ty;
+  const bool in_bottom = ay > bottom;
+
+  *push_x = 0;
+  *push_y = 0;
+
+  if ((in_left || in_right) && (in_top || in_bottom)) {
+    const int vx = ax - (in_left ? tx : right);
+    const int vy = ay - (in_top ? ty : bottom);
+    const int d2 = vx * vx + vy * vy;
+    if (d2 < radius * radius) {
+      const int len = isqrt(d2); // At least 1, the body is off the corner
+      *push_x = (radius - len) * vx / len;
+      *push_y = (radius - len) * vy / len;
+    }
+    return;
+  }
+
+  const int dx = ax - (tx + TILE_SIZE / 2);
+  const int dy = ay - (ty + TILE_SIZE / 2);
+  if (dx == 0 && dy == 0) {
+    // Really rare but can happen e.g. with doors
+    log_e("Body centered on a wall tile", 0);
+    *push_x = 1;
+  }
+  else if (abs(dx) > abs(dy)) {
+    *push_x = dx <= 0 ? tx - (ax + radius) : right - (ax - radius);
+  }
+  else {
+    *push_y = dy <= 0 ? ty - (ay + radius) : bottom - (ay - radius);
+  }
+}
+
+
+// Pushes the body out of the walls it overlaps. Bodies are smaller than a
+// tile so each overlaps at most 2 x 2 tiles. Returns true if it moved.
+bool collide_level_actor (const Level* const level, int* const ax, int* const ay, const int radius) {
+  assert(2 * radius < TILE_SIZE);
+
+  const int left = tc(*ax - radius);
+  const int top = tc(*ay - radius);
+  const int right = tc(*ax + radius);
+  const int bottom = tc(*ay + radius);
+  bool moved = false;
+
+  for (int ty = top; ty <= bottom; ++ty) {
+    for (int tx = left; tx <= right; ++tx) {
+      const int tcx = pc_corner(tx);
+      const int tcy = pc_corner(ty);
+      const bool overlaps = *ax + radius > tcx && *ay + radius > tcy &&
+        *ax - radius < tcx + TILE_SIZE && *ay - radius < tcy + TILE_SIZE;
+      if (!overlaps || passable(level, tx, ty)) {
+        continue;
+      }
+
+      int px;
+      int py;
+      tile_push(tcx, tcy, *ax, *ay, radius, &px, &py);
+
+      // One unit more, so that the body ends up clear of the tile
+      px += isign(px);
+      py += isign(py);
+      *ax += px;
+      *ay += py;
+      moved = moved || px != 0 || py != 0;
+    }
+  }
+
+  return moved;
+}
+
+
+typedef struct {
+  int iterations;   // Settle iterations run
+  int level_tests;  // Bodies tested against the level
+  int pair_tests;   // collide_actor_actor() calls
+  int unsettled;    // Bodies still moving when giving up, 0 if settled
+} CollisionStats;
+
+
+// Bodies bucketed by the tile they are centered on
+typedef struct {
+  int width;
+  int height;
+  int* heads;     // First body in each cell, -1 if none
+  int* next;      // Next body in the same cell, -1 if none
+  int* cells;     // Cell of each body
+  int bucketed;   // Number of bodies in the cells
+  bool* awake;    // Bodies to test in the current settle iteration
+  bool* moved;    // Bodies pushed in the current settle iteration
+  int* x;         // Body positions and sizes, copied in and out by the caller
+  int* y;
+  int* radius;
+  int len;
+  int max;
+  int max_radius;
+  CollisionStats stats; // Of the last settle_collisions()
+} Broadphase;
+
+
+void free_broadphase (Broadphase* const bp) {
+  if (bp != NULL) {
+    free(bp->heads);
+    free(bp->next);
+    free(bp->cells);
+    free(bp->awake);
+    free(bp->moved);
+    free(bp->x);
+    free(bp->y);
+    free(bp->radius);
+    free(bp);
+  }
+}
+
+
+// Makes room for at least max bodies
+bool reserve_broadphase (Broadphase* const bp, const int max) {
+  if (max <= bp->max) {
+    return true;
+  }
+
+  bool* const awake = realloc(bp->awake, max * sizeof(bool));
+  if (awake != NULL) {
+    bp->awake = awake;
+  }
+  bool* const moved = realloc(bp->moved, max * sizeof(bool));
+  if (moved != NULL) {
+    bp->moved = moved;
+  }
+
+  if (!awake || !moved || !grow_ints(&bp->next, max) || !grow_ints(&bp->cells, max) ||
+      !grow_ints(&bp->x, max) || !grow_ints(&bp->y, max) || !grow_ints(&bp->radius, max)) {
+    log_e("Failed to grow broadphase to %d bodies: %s", max, strerror(errno));
+    return false;
+  }
+
+  bp->max = max;
+  return true;
+}
+
+
+Broadphase* new_broadphase (const int width, const int height, const int max) {
+  Broadphase* const bp = calloc(1, sizeof(Broadphase));
+  if (bp == NULL) {
+    log_e("Failed to allocate Broadphase: %s", strerror(errno));
+    return NULL;
+  }
+
+  bp->width = width;
+  bp->height = height;
+  bp->heads = malloc(width * height * sizeof(int));
+  if (!bp->heads || !reserve_broadphase(bp, max)) {
+    log_e("Failed to allocate broadphase grid: %s", strerror(errno));
+    free_broadphase(bp);
+    return NULL;
+  }
+
+  for (int i = 0; i < width * height; ++i) {
+    bp->heads[i] = -1;
+  }
+
+  return bp;
+}
+
+
+// Rebuckets all bodies by their current position
+void broadphase_update (Broadphase* const bp) {
+  bp->max_radius = 0;
+
+  for (int i = 0; i < bp->bucketed; ++i) {
+    bp->heads[bp->cells[i]] = -1;
+  }
+  bp->bucketed = bp->len;
+
+  // Insert in reverse so that each cell lists its bodies in index order
+  for (int i = bp->len - 1; i >= 0; --i) {
+    const int x = clamp(tc(bp->x[i]), 0, bp->width - 1);
+    const int y = clamp(tc(bp->y[i]), 0, bp->height - 1);
+    const int cell = y * bp->width + x;
+
+    bp->cells[i] = cell;
+    bp->next[i] = bp->heads[cell];
+    bp->heads[cell] = i;
+
+    if (bp->radius[i] > bp->max_radius) {
+      bp->max_radius = bp->radius[i];
+    }
+  }
+}
+
+
+int body_cell (const Broadphase* const bp, const int i) {
+  const int x = clamp(tc(bp->x[i]), 0, bp->width - 1);
+  const int y = clamp(tc(bp->y[i]), 0, bp->height - 1);
+  return y * bp->width + x;
+}
+
+
+// Moves body i to the cell it is now centered on
+void broadphase_move (Broadphase* const bp, const int i) {
+  const int cell = body_cell(bp, i);
+  const int old = bp->cells[i];
+  if (cell == old) {
+    return;
+  }
+
+  int* link = &bp->heads[old];
+  while (*link != i) {
+    link = &bp->next[*link];
+  }
+  *link = bp->next[i];
+
+  // Keep cells in index order so that pairs are tested in a stable order
+  link = &bp->heads[cell];
+  while (*link != -1 && *link < i) {
+    link = &bp->next[*link];
+  }
+  bp->cells[i] = cell;
+  bp->next[i] = *link;
+  *link = i;
+}
+
+
+// Collides each awake body with every body close enough to possibly touch
+// it. Each pair is tested once with the lower index first.
+void broadphase_collide (Broadphase* const bp) {
+  for (int i = 0; i < bp->len; ++i) {
+    if (!bp->awake[i]) {
+      continue;
+    }
+
+    const int reach = bp->radius[i] + bp->max_radius;
+    const int left = clamp(tc(bp->x[i] - reach), 0, bp->width - 1);
+    const int right = clamp(tc(bp->x[i] + reach), 0, bp->width - 1);
+    const int top = clamp(tc(bp->y[i] - reach), 0, bp->height - 1);
+    const int bottom = clamp(tc(bp->y[i] + reach), 0, bp->height - 1);
+
+    for (int y = top; y <= bottom; ++y) {
+      for (int x = left; x <= right; ++x) {
+        for (int j = bp->heads[y * bp->width + x]; j != -1; j = bp->next[j]) {
+          if (j == i || (bp->awake[j] && j < i)) {
+            continue;
+          }
+
+          const int first = i < j ? i : j;
+          const int second = i < j ? j : i;
+          ++bp->stats.pair_tests;
+          if (collide_actor_actor(bp->x, bp->y, bp->radius, first, second)) {
+            bp->moved[first] = true;
+            bp->moved[second] = true;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+// Pushes bodies out of walls and each other until nothing moves. After the
+// first iteration only bodies pushed in the previous one are tested again,
+// against the level and against their neighbors.
+void settle_collisions (const Level* level, Broadphase* const bp) {
+  static const int tries = 10;
+
+  CollisionStats* const stats = &bp->stats;
+  memset(stats, 0, sizeof(CollisionStats));
+
+  for (int i = 0; i < bp->len; ++i) {
+    bp->awake[i] = true;
+  }
+  int awake = bp->len;
+
+  broadphase_update(bp);
+
+  while (awake > 0) {
+    if (stats->iterations == tries) {
+      /* log_e("Collision state still unsettled after %d tries, giving up!", */
+      /*     tries); */
+      stats->unsettled = awake;
+      break;
+    }
+    ++stats->iterations;
+
+    for (int i = 0; i < bp->len; ++i) {
+      bp->moved[i] = false;
+      if (bp->awake[i]) {
+        ++stats->level_tests;
+        if (collide_level_actor(level, &bp->x[i], &bp->y[i], bp->radius[i])) {
+          bp->moved[i] = true;
+          broadphase_move(bp, i);
+        }
+      }
+    }
+
+    broadphase_collide(bp);
+
+    awake = 0;
+    for (int i = 0; i < bp->len; ++i) {
+      bp->awake[i] = bp->moved[i];
+      if (bp->moved[i]) {
+        broadphase_move(bp, i);
+        ++awake;
+      }
+    }
+  }
+}
+
+
+// Flips the tile after its activation time has passed
+bool schedule_flip (Level* const level, const int x, const int y) {
+  const int i = tile_index(level, x, y);
+  const int at = level->tick + tile_type(level, x, y)->activation_time + 1;
+  if (!heap_push(&level->flips, at, i)) {
+    return false;
+  }
+  bit_set(level->flipping_bits, i);
+  return true;
+}
+
+
+void check_tiles (Level* const level) {
+  for (int i = 0; i < level->occupied_len; ++i) {
+    bit_clear(level->occupied_bits, level->occupied[i]);
+  }
+  level->occupied_len = 0;
+
+  ++level->tick;
+
+  while (level->flips.len > 0 && level->flips.nodes[0].key <= level->tick) {
+    const int i = heap_pop(&level->flips).value;
+    const int x = i % level->width;
+    const int y = i / level->width;
+
+    bit_clear(level->flipping_bits, i);
+    set_active(level, i, !bit_get(level->active_bits, i));
+    ++level->version;
+
+    update_neighbor_masks(level, x - 1, y - 1, x + 1, y + 1);
+  }
+}
+
+
+Point* add_point (Point* head, int x, int y) {
+  Point* p = malloc(sizeof(Point));
+  p->x = x;
+  p->y = y;
+  p->next = head;
+  return p;
+}
+
+
+Point* remove_point (Point* head, int x, int y) {
+  if (head == NULL) {
+    return NULL;
+  }
+  else if (head->x == x && head->y == y) {
+    Point* new_head = head->next;
+    free(head);
+    return new_head;
+  }
+  else {
+    for (Point* i = head; i->next != NULL; i = i->next) {
+      if (i->next->x == x && i->next->y == y) {
+        Point* new_next = i->next->next;
+        free(i->next);
+        i->next = new_next;
+        break;
+      }
+      
+    }
+    return head;
+  }
+}
+
+
+bool has_point (Point* head, int x, int y) {
+  while (head != NULL) {
+    if (head->x == x && head->y == y) {
+      return true;
+    }
+    head = head->next;
+  }
+  return false;
+}
+
+
+void free_point_list (Point* point) {
+  if (point != NULL) {
+    free_point_list(point->next);
+    free(point);
+  }
+}
+
+
+void free_actor_list (ActorList* const list) {
+  if (list != NULL) {
+    for (int i = 0; i < list->len; ++i) {
+      free_point_list(list->minds[i].path);
+    }
+    free(list->x);
+    free(list->y);
+    free(list->angle);
+    free(list->radius);
+    free(list->prev_x);
+    free(list->prev_y);
+    free(list->minds);
+    free(list);
+  }
+}
+
+
+bool reserve_actor_list (ActorList* const list, const int max) {
+  if (max <= list->max) {
+    return true;
+  }
+
+  ActorMind* const minds = realloc(list->minds, max * sizeof(ActorMind));
+  if (minds != NULL) {
+    list->minds = minds;
+  }
+
+  if (!minds || !grow_ints(&list->x, max) || !grow_ints(&list->y, max) ||
+      !grow_ints(&list->angle, max) || !grow_ints(&list->radius, max) ||
+      !grow_ints(&list->prev_x, max) || !grow_ints(&list->prev_y, max)) {
+    log_e("Failed to grow actor list to %d: %s", max, strerror(errno));
+    return false;
+  }
+
+  list->max = max;
+  return true;
+}
+
+
+ActorList* new_actor_list (const int max) {
+  ActorList* const list = calloc(1, sizeof(ActorList));
+  if (list == NULL) {
+    log_e("Failed to allocate ActorList: %s", strerror(errno));
+    return NULL;
+  }
+
+  if (!reserve_actor_list(list, max)) {
+    free_actor_list(list);
+    return NULL;
+  }
+
+  return list;
+}
+
+
+// Returns the index of the new actor, or -1 if the list could not grow
+int add_actor (ActorList* const list, int x, int y, int angle, int radius) {
+  if (list->len == list->max &&
+      !reserve_actor_list(list, list->max > 0 ? 2 * list->max : 16)) {
+    return -1;
+  }
+
+  const int i = list->len++;
+  list->x[i] = x;
+  list->y[i] = y;
+  list->angle[i] = angle;
+  list->radius[i] = radius;
+  list->prev_x[i] = x;
+  list->prev_y[i] = y;
+
+  ActorMind* const mind = &list->minds[i];
+  mind->base_x = x;
+  mind->base_y = y;
+  mind->base_angle = angle;
+  mind->tx = -1;
+  mind->ty = -1;
+  mind->t_angle = -1;
+  mind->give_up_at = -1;
+  mind->path = NULL;
+
+  return i;
+}
+
+
+Point* remove_last_point (Point* point) {
+  if (point == NULL) {
+    return NULL;
+  }
+  else {
+    Point* new_next = point->next;
+    free(point);
+    return point->next;
+  }
+}
+
+
+int find_path_h (int x1, int y1, int x2, int y2) {
+  const int dx = x2 - x1;
+  const int dy = y2 - y1;
+  return dx*dx + dy*dy;
+}
+
+
+Point* neighbors (const Level* level, int x, int y) {
+  const uint8_t mask = neighbor_mask(level, x, y);
+
+  Point* n = NULL;
+  for (int i = 0; i < 8; ++i) {
+    if (mask & (1 << i)) {
+      n = add_point(n, x + NEIGHBOR_OFFSETS[i].x, y + NEIGHBOR_OFFSETS[i].y);
+    }
+  }
+
+  return n;
+}
+
+
+bool dfs (const Level* level, Point** path, int x1, int y1, int x2, int y2) {
+  if (x1 >= 0 && y1 >= 0 && x1 < level->width && y1 < level->height &&
+      !has_point(*path, x1, y1) && passable(level, x1, y1)) {
+    *path = add_point(*path, x1, y1);
+
+    if (x1 == x2 && y1 == y2) {
+      return true;
+    }
+
+    Point* n = neighbors(level, x1, y1); 
+
+    while (n != NULL) {
+      Point* best = n;
+      int best_h = find_path_h(n->x, n->y, x2, y2);
+      for (Point* i = n->next; i != NULL; i = i->next) {
+        const int i_h = find_path_h(i->x, i->y, x2, y2);
+        if (i_h < best_h) {
+          best = i;
+          best_h = i_h;
+        }
+      }
+
+      if (dfs(level, path, best->x, best->y, x2, y2)) {
+        return true;
+      }
+      else {
+        n = remove_point(n, best->x, best->y);
+      }
+    }
+
+    *path = remove_last_point(*path);
+  }
+
+  return false;
+}
+
+
+Point* a_star (const Level* level, PathScratch* const scratch, int x1, int y1, int x2, int y2) {
+  PathNode* const nodes = scratch->nodes;
+  Heap* const open = &scratch->open;
+
+  const int w = level->width;
+  const int start = y1 * w + x1;
+  const int goal = y2 * w + x2;
+
+  path_scratch_reset(scratch);
+
+  const PathNode first = { scratch->gen, false, 0, find_path_h(x1, y1, x2, y2), start };
+  nodes[start] = first;
+  heap_push(open, first.f, start);
+
+  Point* path = NULL;
+  int expanded = 0;
+
+  while (open->len > 0) {
+    const HeapNode top = heap_pop(open);
+    PathNode* const cur = &nodes[top.value];
+
+    // Stale entry: expanded or improved since it was pushed
+    if (cur->closed || top.key != cur->f) {
+      continue;
+    }
+    ++expanded;
+
+    if (top.value == goal) {
+      int i = goal;
+      path = add_point(NULL, x2, y2);
+      while (i != start) {
+        i = nodes[i].from;
+        path = add_point(path, i % w, i / w);
+      }
+      break;
+    }
+
+    cur->closed = true;
+
+    const int cx = top.value % w;
+    const int cy = top.value / w;
+
+    const uint8_t mask = level->neighbor_masks[top.value];
+    for (int i = 0; i < 8; ++i) {
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+
+      const int nx = cx + NEIGHBOR_OFFSETS[i].x;
+      const int ny = cy + NEIGHBOR_OFFSETS[i].y;
+      PathNode* const next = &nodes[ny * w + nx];
+      const int tg = cur->g + NEIGHBOR_OFFSETS[i].cost;
+
+      // Closed nodes are reopened if a shorter route turns up, the
+      // heuristic being inconsistent
+      if (next->gen != scratch->gen || tg < next->g) {
+        next->gen = scratch->gen;
+        next->closed = false;
+        next->g = tg;
+        next->f = tg + find_path_h(nx, ny, x2, y2);
+        next->from = top.value;
+        if (!heap_push(open, next->f, ny * w + nx)) {
+          open->len = 0;
+          break;
+        }
+      }
+    }
+  }
+
+  counter_add(COUNTER_NODES, expanded);
+  return path;
+}
+
+
+bool walkable (const Level* level, int x, int y) {
+  return x >= 0 && y >= 0 && x < level->width && y < level->height && passable(level, x, y);
+}
+
+
+// Walks from (x, y) in direction (dx, dy) until reaching the goal or a
+// tile with a forced neighbor. Returns the tile index or -1 on a dead end.
+int jump (const Level* level, int x, int y, const int dx, const int dy, const int goal) {
+  for (;;) {
+    // Diagonal steps may not cut corners, as in compute_neighbor_mask()
+    if (!walkable(level, x + dx, y + dy) ||
+        (dx != 0 && dy != 0 && !(walkable(level, x + dx, y) && walkable(level, x, y + dy)))) {
+      return -1;
+    }
+
+    x += dx;
+    y += dy;
+
+    const int i = y * level->width + x;
+    if (i == goal) {
+      return i;
+    }
+
+    if (dx != 0 && dy != 0) {
+      if (jump(level, x, y, dx, 0, goal) != -1 || jump(level, x, y, 0, dy, goal) != -1) {
+        return i;
+      }
+    }
+    else if (dx != 0) {
+      if ((walkable(level, x, y - 1) && !walkable(level, x - dx, y - 1)) ||
+          (walkable(level, x, y + 1) && !walkable(level, x - dx, y + 1))) {
+        return i;
+      }
+    }
+    else {
+      if ((walkable(level, x - 1, y) && !walkable(level, x - 1, y - dy)) ||
+          (walkable(level, x + 1, y) && !walkable(level, x + 1, y - dy))) {
+        return i;
+      }
+    }
+  }
+}
+
+
+// Directions worth jumping in from (x, y) when arrived at in direction
+// (dx, dy), or all directions for (0, 0). Returns the direction count.
+int jps_directions (const Level* level, int x, int y, int dx, int dy, Offset dirs[8]) {
+  int n = 0;
+
+  if (dx == 0 && dy == 0) {
+    const uint8_t mask = neighbor_mask(level, x, y);
+    for (int i = 0; i < 8; ++i) {
+      if (mask & (1 << i)) {
+        dirs[n++] = NEIGHBOR_OFFSETS[i];
+      }
+    }
+    return n;
+  }
+
+  const Offset dir = { dx, dy, 0 };
+
+  if (dx != 0 && dy != 0) {
+    const bool horizontal = walkable(level, x + dx, y);
+    const bool vertical = walkable(level, x, y + dy);
+    if (vertical) {
+      dirs[n].x = 0;
+      dirs[n++].y = dy;
+    }
+    if (horizontal) {
+      dirs[n].x = dx;
+      dirs[n++].y = 0;
+    }
+    if (horizontal && vertical) {
+      dirs[n++] = dir;
+    }
+  }
+  else {
+    // Sides of the direction of travel
+    const int sx = dy;
+    const int sy = dx;
+    const bool next = walkable(level, x + dx, y + dy);
+    const bool side_a = walkable(level, x + sx, y + sy);
+    const bool side_b = walkable(level, x - sx, y - sy);
+
+    if (next) {
+      dirs[n++] = dir;
+      if (side_a) {
+        dirs[n].x = dx + sx;
+        dirs[n++].y = dy + sy;
+      }
+      if (side_b) {
+        dirs[n].x = dx - sx;
+        dirs[n++].y = dy - sy;
+      }
+    }
+    if (side_a) {
+      dirs[n].x = sx;
+      dirs[n++].y = sy;
+    }
+    if (side_b) {
+      dirs[n].x = -sx;
+      dirs[n++].y = -sy;
+    }
+  }
+
+  return n;
+}
+
+
+// Jump point search. Uses the same step costs as a_star(), under which a
+// jump between two jump points costs their Manhattan distance.
+Point* jps (const Level* level, PathScratch* const scratch, int x1, int y1, int x2, int y2) {
+  PathNode* const nodes = scratch->nodes;
+  Heap* const open = &scratch->open;
+
+  const int w = level->width;
+  const int start = y1 * w + x1;
+  const int goal = y2 * w + x2;
+
+  path_scratch_reset(scratch);
+
+  const PathNode first = { scratch->gen, false, 0, abs(x2 - x1) + abs(y2 - y1), start };
+  nodes[start] = first;
+  heap_push(open, first.f, start);
+
+  Point* path = NULL;
+  int expanded = 0;
+
+  while (open->len > 0) {
+    const HeapNode top = heap_pop(open);
+    PathNode* const cur = &nodes[top.value];
+
+    if (cur->closed || top.key != cur->f) {
+      continue;
+    }
+    ++expanded;
+
+    const int cx = top.value % w;
+    const int cy = top.value / w;
+
+    if (top.value == goal) {
+      // Fill in the tiles between jump points
+      int x = cx;
+      int y = cy;
+      path = add_point(NULL, x, y);
+      for (int i = goal; i != start; i = nodes[i].from) {
+        const int fx = nodes[i].from % w;
+        const int fy = nodes[i].from / w;
+        const int sx = sign(fx - x);
+        const int sy = sign(fy - y);
+        while (x != fx || y != fy) {
+          x += sx;
+          y += sy;
+          path = add_point(path, x, y);
+        }
+      }
+      break;
+    }
+
+    cur->closed = true;
+
+    int dx = 0;
+    int dy = 0;
+    if (top.value != start) {
+      dx = sign(cx - cur->from % w);
+      dy = sign(cy - cur->from / w);
+    }
+
+    Offset dirs[8];
+    const int dir_count = jps_directions(level, cx, cy, dx, dy, dirs);
+    for (int i = 0; i < dir_count; ++i) {
+      const int j = jump(level, cx, cy, dirs[i].x, dirs[i].y, goal);
+      if (j == -1) {
+        continue;
+      }
+
+      const int jx = j % w;
+      const int jy = j / w;
+      PathNode* const next = &nodes[j];
+      const int tg = cur->g + abs(jx - cx) + abs(jy - cy);
+
+      if (next->gen != scratch->gen || tg < next->g) {
+        next->gen = scratch->gen;
+        next->closed = false;
+        next->g = tg;
+        next->f = tg + abs(x2 - jx) + abs(y2 - jy);
+        next->from = top.value;
+        if (!heap_push(open, next->f, j)) {
+          open->len = 0;
+          break;
+        }
+      }
+    }
+  }
+
+  counter_add(COUNTER_NODES, expanded);
+  return path;
+}
+
+
+void mark_path (MarkList* mark_list, const Point* path) {
+  if (!MARK_ENABLED[MARK_ACTOR_PATH]) {
+    return;
+  }
+
+  for (const Point* i = path; i != NULL; i = i->next) {
+    mark(mark_list, MARK_ACTOR_PATH, i->x, i->y);
+  }
+}
+
+
+Point* find_path (MarkList* mark_list, const Level* level, PathScratch* const scratch, int x1, int y1, int x2, int y2) {
+  Point* path = NULL;
+  //dfs(level, &path, x1, y1, x2, y2);
+  switch (PATH_SEARCH) {
+    case SEARCH_A_STAR:
+      path = a_star(level, scratch, x1, y1, x2, y2);
+      break;
+
+    case SEARCH_JPS:
+      path = jps(level, scratch, x1, y1, x2, y2);
+      break;
+  }
+  mark_path(mark_list, path);
+  return path;
+}
+
+
+// A path the level has changed under is searched again on one frame in
+// this many, staggered by actor, unless a tile left on it has closed. A
+// door flip then only sends the actors it blocks into a search at once.
+static const int REPLAN_FRAMES = 30;
+
+
+bool path_blocked (const Level* level, const Point* path) {
+  for (const Point* p = path; p != NULL; p = p->next) {
+    if (!passable(level, p->x, p->y)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// Returns the actor's cached path advanced to (x1, y1), replanning only if
+// the goal or the level has changed or the actor has strayed off the path.
+// replan_due is true on the actor's turn to replan around level changes.
+const Point* cached_path (MarkList* mark_list, const Level* level, PathScratch* const scratch, bool replan_due, ActorMind* actor, int x1, int y1, int x2, int y2) {
+  const bool fresh = actor->path_version == level->version ||
+    (!replan_due && !path_blocked(level, actor->path));
+  if (actor->path != NULL && fresh && actor->path_gx == x2 && actor->path_gy == y2) {
+    Point* start = actor->path;
+    while (start != NULL && (start->x != x1 || start->y != y1)) {
+      start = start->next;
+    }
+
+    if (start != NULL) {
+      while (actor->path != start) {
+        Point* const next = actor->path->next;
+        free(actor->path);
+        actor->path = next;
+      }
+      mark_path(mark_list, actor->path);
+      return actor->path;
+    }
+  }
+
+  free_point_list(actor->path);
+  actor->path = find_path(mark_list, level, scratch, x1, y1, x2, y2);
+  actor->path_gx = x2;
+  actor->path_gy = y2;
+  actor->path_version = level->version;
+  return actor->path;
+}
+
+
+void compute_flow_field (const Level* level, PathScratch* const scratch, FlowField* const field, const int goal) {
+  const int w = level->width;
+  Heap* const open = &scratch->open;
+  int expanded = 0;
+
+  for (int i = 0; i < level->flow->size; ++i) {
+    field->dist[i] = FLOW_UNREACHABLE;
+  }
+
+  open->len = 0;
+  field->dist[goal] = 0;
+  heap_push(open, 0, goal);
+
+  while (open->len > 0) {
+    const HeapNode top = heap_pop(open);
+    if (top.key != field->dist[top.value]) {
+      continue;
+    }
+    ++expanded;
+
+    const int cx = top.value % w;
+    const int cy = top.value / w;
+
+    const uint8_t mask = level->neighbor_masks[top.value];
+    for (int i = 0; i < 8; ++i) {
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+
+      const int ni = (cy + NEIGHBOR_OFFSETS[i].y) * w + cx + NEIGHBOR_OFFSETS[i].x;
+      const int dist = top.key + NEIGHBOR_OFFSETS[i].cost;
+      if (dist < field->dist[ni]) {
+        field->dist[ni] = dist;
+        if (!heap_push(open, dist, ni)) {
+          open->len = 0;
+          break;
+        }
+      }
+    }
+  }
+
+  field->goal = goal;
+  field->version = level->version;
+  counter_add(COUNTER_NODES, expanded);
+}
+
+
+// Picks the cached field to hold goal: the one already rooted there, or
+// else the least recently used one not yet taken this frame. The caller
+// computes it if it is stale.
+FlowField* claim_flow_field (const Level* level, const int goal, unsigned int* const taken) {
+  FlowCache* const flow = level->flow;
+
+  int best = -1;
+  for (int i = 0; i < FLOW_FIELD_COUNT; ++i) {
+    const FlowField* const f = &flow->fields[i];
+    if (f->goal == goal) {
+      best = i;
+      break;
+    }
+    if (!(*taken & (1u << i)) && (best < 0 || f->used < flow->fields[best].used)) {
+      best = i;
+    }
+  }
+
+  *taken |= 1u << best;
+  FlowField* const field = &flow->fields[best];
+  field->used = ++flow->clock;
+  return field;
+}
+
+
+// Returns the cached field rooted at goal if it is up to date, NULL if not
+const FlowField* cached_flow_field (const Level* level, const int goal) {
+  for (int i = 0; i < FLOW_FIELD_COUNT; ++i) {
+    const FlowField* const f = &level->flow->fields[i];
+    if (f->goal == goal && f->version == level->version) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+
+// Finds the neighbor of (x, y) closest to the goal of the field
+bool flow_step (const Level* level, const FlowField* field, int x, int y, int* nx, int* ny) {
+  int best = field->dist[y * level->width + x];
+  *nx = x;
+  *ny = y;
+
+  const uint8_t mask = neighbor_mask(level, x, y);
+  for (int i = 0; i < 8; ++i) {
+    if (!(mask & (1 << i))) {
+      continue;
+    }
+
+    const int ix = x + NEIGHBOR_OFFSETS[i].x;
+    const int iy = y + NEIGHBOR_OFFSETS[i].y;
+    const int dist = field->dist[iy * level->width + ix];
+    if (dist < best) {
+      best = dist;
+      *nx = ix;
+      *ny = iy;
+    }
+  }
+
+  return best != FLOW_UNREACHABLE;
+}
+
+
+void mark_flow_path (MarkList* mark_list, const Level* level, const FlowField* field, int x, int y) {
+  if (!MARK_ENABLED[MARK_ACTOR_PATH]) {
+    return;
+  }
+
+  mark(mark_list, MARK_ACTOR_PATH, x, y);
+
+  int nx;
+  int ny;
+  while (flow_step(level, field, x, y, &nx, &ny) && (nx != x || ny != y)) {
+    x = nx;
+    y = ny;
+    mark(mark_list, MARK_ACTOR_PATH, x, y);
+  }
+}
+
+
+bool line_of_sight_callback (int x, int y, const void* in, void* out) {
+  const Level* level = in;;
+  return see_through(level, x, y);
+}
+
+
+bool mark_actor_sight_callback (int x, int y, const void* in, void* out) {
+  MarkList* mark_list = out;
+  mark(mark_list, MARK_ACTOR_SIGHT, x, y);
+  return true;
+}
+
+
+bool line_of_sight (MarkList* mark_list, const Level* level, int x1, int y1, int x2, int y2) {
+  if (bresenham(x1, y1, x2, y2, line_of_sight_callback, level, NULL)) {
+    //bresenham(x1, y1, x2, y2, mark_actor_sight_callback, NULL, mark_list);
+    return true;
+  }
+  else {
+    return false;
+  }
+}
+
+
+#define LOS_LANES 8
+
+
+// Traces rays in lockstep, LOS_LANES at a time, stepping each like
+// bresenham() over the see-through bits. Lane state is kept in arrays so
+// that the inner loops can be vectorized.
+void trace_rays (const Level* level, LosQuery* const queries, const int* rays, const int count) {
+  const int w = level->width;
+  const uint32_t* const bits = level->see_through_bits;
+
+  for (int base = 0; base < count; base += LOS_LANES) {
+    const int lanes = count - base < LOS_LANES ? count - base : LOS_LANES;
+
+    int x[LOS_LANES];
+    int y[LOS_LANES];
+    int x1[LOS_LANES];
+    int y1[LOS_LANES];
+    int dx[LOS_LANES];
+    int dy[LOS_LANES];
+    int sx[LOS_LANES];
+    int sy[LOS_LANES];
+    int err[LOS_LANES];
+    bool active[LOS_LANES];
+    bool visible[LOS_LANES];
+
+    for (int l = 0; l < lanes; ++l) {
+      const LosQuery* const q = &queries[rays[base + l]];
+      x[l] = q->from % w;
+      y[l] = q->from / w;
+      x1[l] = q->to % w;
+      y1[l] = q->to / w;
+      dx[l] = abs(x1[l] - x[l]);
+      dy[l] = abs(y1[l] - y[l]);
+      sx[l] = x[l] < x1[l] ? 1 : -1;
+      sy[l] = y[l] < y1[l] ? 1 : -1;
+      err[l] = dx[l] - dy[l];
+      active[l] = true;
+      visible[l] = false;
+    }
+
+    int remaining = lanes;
+    while (remaining > 0) {
+      for (int l = 0; l < lanes; ++l) {
+        if (!active[l]) {
+          continue;
+        }
+
+        const bool arrived = x[l] == x1[l] && y[l] == y1[l];
+        if (arrived || !bit_get(bits, y[l] * w + x[l])) {
+          visible[l] = arrived;
+          active[l] = false;
+          --remaining;
+          continue;
+        }
+
+        const int e2 = 2 * err[l];
+        const bool step_x = e2 > -dy[l];
+        const bool step_y = e2 < dx[l];
+        err[l] += (step_x ? -dy[l] : 0) + (step_y ? dx[l] : 0);
+        x[l] += step_x ? sx[l] : 0;
+        y[l] += step_y ? sy[l] : 0;
+      }
+    }
+
+    for (int l = 0; l < lanes; ++l) {
+      queries[rays[base + l]].visible = visible[l];
+    }
+  }
+}
+
+
+int los_slot (const int from, const int to) {
+  const unsigned int h = (unsigned int)from * 2654435761u ^ (unsigned int)to * 40503u;
+  return (h >> 7) % LOS_CACHE_SIZE;
+}
+
+
+// Returns room for a batch of count queries
+LosQuery* los_queries (const Level* level, const int count) {
+  LosCache* const los = level->los;
+
+  if (count > los->max) {
+    LosQuery* const queries = realloc(los->queries, count * sizeof(LosQuery));
+    if (queries != NULL) {
+      los->queries = queries;
+    }
+    int* const rays = realloc(los->rays, count * sizeof(int));
+    if (rays != NULL) {
+      los->rays = rays;
+    }
+    int* const sources = realloc(los->sources, count * sizeof(int));
+    if (sources != NULL) {
+      los->sources = sources;
+    }
+    if (queries == NULL || rays == NULL || sources == NULL) {
+      log_e("Failed to grow line of sight batch to %d: %s", count, strerror(errno));
+      return NULL;
+    }
+    los->max = count;
+  }
+
+  return los->queries;
+}
+
+
+// Answers all queries, tracing each pair that is neither cached nor
+// repeated earlier in the batch. The queries must come from los_queries().
+void line_of_sight_batch (const Level* level, LosQuery* const queries, const int count) {
+  LosCache* const los = level->los;
+  assert(count <= los->max);
+
+  int ray_count = 0;
+  for (int i = 0; i < count; ++i) {
+    LosQuery* const q = &queries[i];
+    LosEntry* const e = &los->entries[los_slot(q->from, q->to)];
+
+    los->sources[i] = -1;
+    if (e->from == q->from && e->to == q->to && e->version == level->version) {
+      if (e->ray >= 0) {
+        los->sources[i] = e->ray;
+      }
+      else {
+        q->visible = e->visible;
+      }
+      continue;
+    }
+
+    e->from = q->from;
+    e->to = q->to;
+    e->version = level->version;
+    e->ray = i;
+    los->rays[ray_count++] = i;
+  }
+
+  trace_rays(level, queries, los->rays, ray_count);
+  counter_add(COUNTER_RAYS, ray_count);
+
+  for (int i = 0; i < ray_count; ++i) {
+    const LosQuery* const q = &queries[los->rays[i]];
+    LosEntry* const e = &los->entries[los_slot(q->from, q->to)];
+    if (e->ray == los->rays[i]) {
+      e->visible = q->visible;
+      e->ray = -1;
+    }
+  }
+
+  for (int i = 0; i < count; ++i) {
+    if (los->sources[i] >= 0) {
+      queries[i].visible = queries[los->sources[i]].visible;
+    }
+  }
+}
+
+
+int angle_dir (int angle) {
+  if (angle < -180) {
+    angle += 360;
+  }
+  else if (angle > 180) {
+    angle -= 360;
+  }
+  return angle;
+}
+
+
+int angle_diff (int a, int b) {
+  return angle_dir(b - a);
+}
+
+
+int angle_vector_diff (int angle, int dx, int dy) {
+  int angle_2 = atan2(-dy, dx) / M_PI * 180.0;
+  if (angle_2 < 0) {
+    angle_2 += 360;
+  }
+  return angle_diff(angle, angle_2);
+}
+
+
+bool has_target (const ActorMind* actor) {
+  return actor->tx != -1 && actor->ty != -1;
+}
+
+
+bool is_chasing (const ActorMind* actor) {
+  return has_target(actor) && (actor->tx != actor->base_x || actor->ty != actor->base_y);
+}
+
+
+// What each worker needs to plan actor moves without touching shared state
+typedef struct {
+  PathScratch* scratch;
+  MarkList marks;
+  FlowField field; // For goals that did not fit in the level's cache
+} AiWorker;
+
+
+typedef struct {
+  WorkerPool* pool;
+  AiWorker workers[MAX_WORKERS];
+  bool* sees;      // Whether each actor sees the player this frame
+  bool* awake;     // Whether each actor thinks at all this frame
+  bool* looks;     // Whether each actor checks its line of sight this frame
+  int max;
+} Ai;
+
+
+void free_ai (Ai* const ai) {
+  if (ai != NULL) {
+    if (ai->pool != NULL) {
+      for (int i = 0; i < ai->pool->count; ++i) {
+        free_path_scratch(ai->workers[i].scratch);
+        free_mark_list(&ai->workers[i].marks);
+        free(ai->workers[i].field.dist);
+      }
+    }
+    free_worker_pool(ai->pool);
+    free(ai->sees);
+    free(ai->awake);
+    free(ai->looks);
+    free(ai);
+  }
+}
+
+
+// Plans with the given number of threads, 0 for one per CPU
+Ai* new_ai (const Level* level, const int threads) {
+  Ai* const ai = calloc(1, sizeof(Ai));
+  if (ai == NULL) {
+    log_e("Failed to allocate Ai: %s", strerror(errno));
+    return NULL;
+  }
+
+  ai->pool = new_worker_pool(threads);
+  if (ai->pool == NULL) {
+    free_ai(ai);
+    return NULL;
+  }
+
+  const int size = level->width * level->height;
+  for (int i = 0; i < ai->pool->count; ++i) {
+    AiWorker* const w = &ai->workers[i];
+    w->scratch = new_path_scratch(size);
+    w->field.goal = -1;
+    w->field.dist = malloc(size * sizeof(int));
+    if (w->scratch == NULL || w->field.dist == NULL) {
+      log_e("Failed to allocate AI worker %d: %s", i, strerror(errno));
+      free_ai(ai);
+      return NULL;
+    }
+  }
+
+  return ai;
+}
+
+
+// The level's field for goal if there is one, otherwise the worker's own
+const FlowField* worker_flow_field (const Level* level, AiWorker* const worker, const int goal) {
+  const FlowField* const field = cached_flow_field(level, goal);
+  if (field != NULL) {
+    return field;
+  }
+
+  FlowField* const own = &worker->field;
+  if (own->goal != goal || own->version != level->version) {
+    compute_flow_field(level, worker->scratch, own, goal);
+  }
+  return own;
+}
+
+
+bool seek_target (AiWorker* const worker, const Level* level, int frame, const ActorList* actors, int i, int x, int y, int min_d) {
+  MarkList* const mark_list = &worker->marks;
+  ActorMind* const actor = &actors->minds[i];
+  const int ax = actors->x[i];
+  const int ay = actors->y[i];
+
+  bool found = true;
+
+  // Next tile to head for
+  int sx = tc(ax);
+  int sy = tc(ay);
+  bool routed = false;
+
+  // Chasers share the flow field towards their goal, others plan their own
+  const int64_t started = clock_ns();
+  if (is_chasing(actor)) {
+    const FlowField* field = worker_flow_field(level, worker, tile_index(level, tc(x), tc(y)));
+    routed = flow_step(level, field, tc(ax), tc(ay), &sx, &sy);
+    if (routed) {
+      mark_flow_path(mark_list, level, field, tc(ax), tc(ay));
+    }
+  }
+  else {
+    const Point* path = cached_path(mark_list, level, worker->scratch,
+        (frame + i) % REPLAN_FRAMES == 0, actor, tc(ax), tc(ay), tc(x), tc(y));
+    if (path != NULL) {
+      const Point* target = path->next != NULL ? path->next : path;
+      sx = target->x;
+      sy = target->y;
+      routed = true;
+    }
+  }
+  timer_stop(TIMER_PATHS, started);
+
+  if (routed) {
+    const int nx = pc(sx);
+    const int ny = pc(sy);
+
+    int diff = angle_vector_diff(actors->angle[i], nx - ax, ny - ay);
+    const int dist = d(ax, ay, x, y);
+    const int close = dist < min_d + ACTOR_STEP;
+
+    if (abs(diff) > 30) {
+      turn(&actors->angle[i], sign(diff) * 2 * ACTOR_TURN);
+      found = false;
+    }
+    else if (abs(diff) > 10) {
+      turn(&actors->angle[i], sign(diff) * ACTOR_TURN);
+      found = false;
+    }
+    if (abs(diff) < 90 && !close) {
+      move(&actors->x[i], &actors->y[i], actors->angle[i], ACTOR_STEP); 
+      found = false;
+    }
+  }
+  return found;
+}
+
+
+bool should_give_up (int frame, const ActorMind* actor) {
+  return actor->give_up_at >= 0 && actor->give_up_at <= frame;
+}
+
+
+void return_to_base (ActorMind* actor) {
+  actor->tx = actor->base_x;
+  actor->ty = actor->base_y;
+  actor->t_angle = actor->base_angle;
+  actor->give_up_at = -1;
+}
+
+
+bool in_fov (const ActorList* actors, int i, int x, int y) {
+  // Vector from actor to the point
+  const double dx = x - actors->x[i];
+  const double dy = y - actors->y[i];
+
+  int diff = angle_vector_diff(actors->angle[i], dx, dy);
+  return abs(diff) < ACTOR_FOV / 2.0;
+}
+
+
+// Actors are planned in parallel in chunks of this many
+static const int AI_CHUNK = 4;
+
+// Actors farther than AI_NEAR from the player look for it only every
+// AI_FAR_FRAMES frames, staggered so that each frame checks a share of
+// them. Idle actors at base farther than AI_WAKE do not think at all.
+static const bool AI_LOD = true;
+static const int AI_NEAR = 12 * TILE_SIZE;
+static const int AI_WAKE = 24 * TILE_SIZE;
+static const int AI_FAR_FRAMES = 8;
+
+
+typedef struct {
+  int frame;
+  const Level* level;
+  const ActorList* actors;
+  const Actor* player;
+  Ai* ai;
+  FlowField* fields[FLOW_FIELD_COUNT]; // Fields to compute
+  int goals[FLOW_FIELD_COUNT];
+} AiFrame;
+
+
+void compute_flow_job (void* data, int worker, int item) {
+  const AiFrame* const f = data;
+  compute_flow_field(f->level, f->ai->workers[worker].scratch, f->fields[item], f->goals[item]);
+}
+
+
+// Moves actor i towards its target. Only touches the actor itself and the
+// worker's own state.
+void plan_actor (void* data, int worker, int i) {
+  const AiFrame* const f = data;
+  const ActorList* const actors = f->actors;
+  AiWorker* const w = &f->ai->workers[worker];
+  ActorMind* const actor = &actors->minds[i];
+
+  if (!f->ai->awake[i]) {
+    return;
+  }
+
+  const int ax = actors->x[i];
+  const int ay = actors->y[i];
+  const int radius = actors->radius[i];
+  const bool los = f->ai->sees[i];
+
+  if (actor->tx >= 0 && actor->ty >= 0) {
+    const bool found = seek_target(w, f->level, f->frame,
+        actors, i, actor->tx, actor->ty, radius + (los ? f->player->radius : 0));
+    if (found) {
+      if (actor->tx != actor->base_x && actor->ty != actor->base_y) {
+        actor->give_up_at = f->frame + 60;
+      }
+      actor->tx = -1;
+      actor->ty = -1;
+    }
+  }
+
+  if (actor->tx == -1 && actor->ty == -1 && actor->t_angle != -1) {
+    const int ad = angle_diff(actors->angle[i], actor->t_angle);
+    if (ad == 0) {
+      actor->t_angle = -1;
+    }
+    turn(&actors->angle[i], clamp(ad, -ACTOR_TURN, ACTOR_TURN));
+  }
+
+  if (!los && is_chasing(actor)) {
+    mark(&w->marks, MARK_ACTOR_CHASING, ax, ay - radius);
+  }
+}
+
+
+// Perception runs first, over all actors at once. Planning then runs on
+// the worker pool against a level nothing writes to in the meantime.
+void move_actors (int frame, MarkList* mark_list, const ActorList* actors, const Level* level, const Actor* player, Ai* const ai) {
+  const int px = player->x;
+  const int py = player->y;
+
+  if (actors->len > ai->max) {
+    bool* const sees = realloc(ai->sees, actors->len * sizeof(bool));
+    if (sees != NULL) {
+      ai->sees = sees;
+    }
+    bool* const awake = realloc(ai->awake, actors->len * sizeof(bool));
+    if (awake != NULL) {
+      ai->awake = awake;
+    }
+    bool* const looks = realloc(ai->looks, actors->len * sizeof(bool));
+    if (looks != NULL) {
+      ai->looks = looks;
+    }
+    if (sees == NULL || awake == NULL || looks == NULL) {
+      log_e("Failed to grow AI state to %d actors: %s", actors->len, strerror(errno));
+      return;
+    }
+    ai->max = actors->len;
+  }
+
+  // Decide who thinks and who looks this frame
+  int asleep = 0;
+  for (int i = 0; i < actors->len; ++i) {
+    const ActorMind* const actor = &actors->minds[i];
+    const int64_t dx = actors->x[i] - px;
+    const int64_t dy = actors->y[i] - py;
+    const int64_t d2 = dx * dx + dy * dy;
+
+    const bool idle = !has_target(actor) && actor->t_angle == -1 && actor->give_up_at == -1;
+    ai->awake[i] = !AI_LOD || !idle || d2 <= (int64_t)AI_WAKE * AI_WAKE;
+    ai->looks[i] = ai->awake[i] &&
+      (!AI_LOD || d2 <= (int64_t)AI_NEAR * AI_NEAR || (frame + i) % AI_FAR_FRAMES == 0);
+    asleep += !ai->awake[i];
+  }
+  counter_add(COUNTER_ACTORS_ASLEEP, asleep);
+
+  // Line of sight for all looking actors facing the player at once
+  LosQuery* const queries = los_queries(level, actors->len);
+  int count = 0;
+  if (queries != NULL) {
+    for (int i = 0; i < actors->len; ++i) {
+      if (ai->looks[i] && in_fov(actors, i, px, py)) {
+        queries[count].from = tile_index(level, tc(actors->x[i]), tc(actors->y[i]));
+        queries[count].to = tile_index(level, tc(px), tc(py));
+        ++count;
+      }
+    }
+    const int64_t started = clock_ns();
+    line_of_sight_batch(level, queries, count);
+    timer_stop(TIMER_LOS, started);
+  }
+
+  int q = 0;
+  for (int i = 0; i < actors->len; ++i) {
+    ActorMind* const actor = &actors->minds[i];
+
+    const int ax = actors->x[i];
+    const int ay = actors->y[i];
+    const int radius = actors->radius[i];
+
+    // Actors that do not look this frame carry on as if they saw nothing
+    const bool los = queries != NULL && ai->looks[i] && in_fov(actors, i, px, py) && queries[q++].visible;
+    ai->sees[i] = los;
+    if (!ai->awake[i]) {
+      continue;
+    }
+
+    if (los) {
+      mark(mark_list, MARK_ACTOR_SPOTTED, ax, ay - radius);
+      actor->tx = px;
+      actor->ty = py;
+      actor->give_up_at = -1;
+    }
+
+    if (actor->give_up_at != -1) {
+      mark(mark_list, MARK_ACTOR_LOST, ax, ay - radius);
+    }
+
+    if (should_give_up(frame, actor)) {
+      return_to_base(actor);
+    }
+  }
+
+  AiFrame f = {
+    .frame = frame,
+    .level = level,
+    .actors = actors,
+    .player = player,
+    .ai = ai
+  };
+
+  // Give the first goals chased this frame a cached field, computing
+  // stale ones in parallel. Chasers of any further goals use their
+  // worker's own field.
+  int64_t started = clock_ns();
+  int goals = 0;
+  int stale = 0;
+  unsigned int taken = 0;
+  for (int i = 0; i < actors->len && goals < FLOW_FIELD_COUNT; ++i) {
+    const ActorMind* const actor = &actors->minds[i];
+    if (!is_chasing(actor)) {
+      continue;
+    }
+
+    const int goal = tile_index(level, tc(actor->tx), tc(actor->ty));
+    const unsigned int before = taken;
+    FlowField* const field = claim_flow_field(level, goal, &taken);
+    if (taken == before) {
+      continue;
+    }
+    ++goals;
+
+    if (field->goal != goal || field->version != level->version) {
+      f.fields[stale] = field;
+      f.goals[stale] = goal;
+      ++stale;
+    }
+  }
+  run_parallel(ai->pool, stale, 1, compute_flow_job, &f);
+  timer_stop(TIMER_PATHS, started);
+
+  // Each worker's list keeps its buffer from frame to frame
+  for (int w = 0; w < ai->pool->count; ++w) {
+    reset_mark_list(&ai->workers[w].marks);
+  }
+
+  run_parallel(ai->pool, actors->len, AI_CHUNK, plan_actor, &f);
+
+  for (int w = 0; w < ai->pool->count; ++w) {
+    append_marks(mark_list, &ai->workers[w].marks);
+    ai->workers[w].marks.overflows = 0;
+  }
+}
+
+
+void game (int frame, Level* level, MarkList* const mark_list, Actor* const player, const bool actions[], const ActorList* actors, Broadphase* const broadphase, Ai* const ai) {
+  const int PLAYER_TURN = 6;
+  const int PLAYER_STEP = 400;
+
+  const int64_t game_started = clock_ns();
+
+  if (actions[LEFT] | actions[RIGHT]) {
+    turn(&player->angle, actions[LEFT] ? PLAYER_TURN : -PLAYER_TURN);
+  }
+  if (actions[FORWARD] || actions[BACKWARD]) {
+    const int step = actions[FORWARD] ? PLAYER_STEP : -PLAYER_STEP;
+    move(&player->x, &player->y, player->angle, step);
+  }
+
+  move_actors(frame, mark_list, actors, level, player, ai);
+
+  int64_t started = clock_ns();
+  check_tiles(level);
+  timer_stop(TIMER_TILES, started);
+
+  // The player goes first so that it is the first of each pair it is in
+  if (reserve_broadphase(broadphase, actors->len + 1)) {
+    const int n = actors->len;
+    broadphase->len = n + 1;
+    broadphase->x[0] = player->x;
+    broadphase->y[0] = player->y;
+    broadphase->radius[0] = player->radius;
+    memcpy(&broadphase->x[1], actors->x, n * sizeof(int));
+    memcpy(&broadphase->y[1], actors->y, n * sizeof(int));
+    memcpy(&broadphase->radius[1], actors->radius, n * sizeof(int));
+
+    started = clock_ns();
+    settle_collisions(level, broadphase);
+    timer_stop(TIMER_COLLISION, started);
+    counter_add(COUNTER_COLLISION_ITERATIONS, broadphase->stats.iterations);
+    counter_add(COUNTER_COLLISION_UNSETTLED, broadphase->stats.unsettled);
+    counter_add(COUNTER_COLLISION_LEVEL_TESTS, broadphase->stats.level_tests);
+    counter_add(COUNTER_COLLISION_PAIR_TESTS, broadphase->stats.pair_tests);
+
+    player->x = broadphase->x[0];
+    player->y = broadphase->y[0];
+    memcpy(actors->x, &broadphase->x[1], n * sizeof(int));
+    memcpy(actors->y, &broadphase->y[1], n * sizeof(int));
+  }
+
+  const int tx = tc(player->x);
+  const int ty = tc(player->y);
+
+  set_occupied(level, tx, ty);
+
+  for (int i = 0; i < actors->len; ++i) {
+    set_occupied(level, tc(actors->x[i]), tc(actors->y[i]));
+  }
+
+  const double a = player->angle / 180.0 * M_PI;
+
+  double fr = player->radius;
+  int fx;
+  int fy;
+
+  do {
+    fr += TILE_SIZE / 2;
+    fx = tc(player->x + fr * cos(a));
+    fy = tc(player->y - fr * sin(a));
+  }
+  while (fx == tx && fy == ty);
+  if (can_be_activated(level, fx, fy)) {
+    if (actions[ACTIVATE]) {
+      schedule_flip(level, fx, fy);
+      log_d("Tile (%d, %d) is now %s", fx, fy, is_active(level, fx, fy) ? "deactivating" : "activating");
+    }
+    else {
+      mark(mark_list, MARK_TILE_PLAYER_FACING, fx, fy);
+    }
+  }
+
+  timer_stop(TIMER_GAME, game_started);
+}
+
+
+typedef struct {
+  int radius;
+  int cx; // Tile seen from, -1 if not computed yet
+  int cy;
+  unsigned int version; // Level version when computed
+  int ox;
+  int oy;
+  int width;
+  int height;
+  uint32_t* tiles; // Bit per tile, set if visible
+} Sight;
+
+
+Sight* new_sight (const int radius) {
+  Sight* sight = malloc(sizeof(Sight));
+  if (sight == NULL) {
+    log_e("Failed to allocate Sight: %s", strerror(errno));
+    return NULL;
+  }
+
+  const int side = 2 * radius + 1;
+  sight->tiles = calloc(bitset_words(side * side), sizeof(uint32_t));
+  if (sight->tiles == NULL) {
+    log_e("Failed to allocate sight table: %s", strerror(errno));
+    free(sight);
+    return NULL;
+  }
+
+  sight->radius = radius;
+  sight->cx = -1;
+  sight->cy = -1;
+  sight->version = 0;
+  sight->ox = 0;
+  sight->oy = 0;
+  sight->width = 0;
+  sight->height = 0;
+
+  return sight;
+}
+
+
+void free_sight (Sight* const sight) {
+  if (sight != NULL) {
+    free(sight->tiles);
+    free(sight);
+  }
+}
+
+
+void sight_set (Sight* const sight, int x, int y) {
+  const int sx = x - sight->ox;
+  const int sy = y - sight->oy;
+  assert(sx >= 0);
+  assert(sy >= 0);
+  assert(sx < sight->width);
+  assert(sy < sight->height);
+  bit_set(sight->tiles, sy * sight->width + sx);
+}
+
+
+bool sight_get (const Sight* const sight, int x, int y) {
+  const int sx = x - sight->ox;
+  const int sy = y - sight->oy;
+  if (sx < 0 || sy < 0 || sx >= sight->width || sy >= sight->height) {
+    return false;
+  }
+  return bit_get(sight->tiles, sy * sight->width + sx);
+}
+
+
+// Transforms octant coordinates (col, row) to level coordinates
+static const int OCTANTS[8][4] = {
+  {  1,  0,  0,  1 },
+  {  0,  1,  1,  0 },
+  {  0, -1,  1,  0 },
+  { -1,  0,  0,  1 },
+  { -1,  0,  0, -1 },
+  {  0, -1, -1,  0 },
+  {  0,  1, -1,  0 },
+  {  1,  0,  0, -1 },
+};
+
+
+// Recursive shadowcasting over one octant, from row outwards between the
+// start and end slopes
+void cast_light (const Level* level, Sight* const sight, const int* octant,
+    int ox, int oy, int radius, int row, double start, double end) {
+  if (start < end) {
+    return;
+  }
+
+  double next_start = start;
+
+  for (int j = row; j <= radius; ++j) {
+    bool blocked = false;
+
+    for (int dx = -j; dx <= 0; ++dx) {
+      const int dy = -j;
+      const double l_slope = (dx - 0.5) / (dy + 0.5);
+      const double r_slope = (dx + 0.5) / (dy - 0.5);
+
+      if (start < r_slope) {
+        continue;
+      }
+      else if (end > l_slope) {
+        break;
+      }
+
+      const int x = ox + dx * octant[0] + dy * octant[1];
+      const int y = oy + dx * octant[2] + dy * octant[3];
+      const bool inside = x >= 0 && y >= 0 && x < level->width && y < level->height;
+
+      if (inside && dx * dx + dy * dy <= radius * radius) {
+        sight_set(sight, x, y);
+      }
+
+      const bool opaque = !inside || !see_through(level, x, y);
+      if (blocked) {
+        if (opaque) {
+          next_start = r_slope;
+        }
+        else {
+          blocked = false;
+          start = next_start;
+        }
+      }
+      else if (opaque && j < radius) {
+        blocked = true;
+        cast_light(level, sight, octant, ox, oy, radius, j + 1, start, l_slope);
+        next_start = r_slope;
+      }
+    }
+
+    if (blocked) {
+      break;
+    }
+  }
+}
+
+
+void compute_sight (Sight* const sight, const Level* level, const int atx, const int aty) {
+  const int64_t started = clock_ns();
+  const int radius = sight->radius;
+
+  // Offset (top left tile)
+  sight->ox = clamp(atx - radius, 0, level->width - 1);
+  sight->oy = clamp(aty - radius, 0, level->height - 1);
+  //log_d("Sight offset: (%d, %d)", sight->ox, sight->oy);
+
+  // Table dimensions
+  // Example: radius 1
+  // ...
+  // .@.
+  // ...
+  sight->width = clamp(atx + radius, 0, level->width - 1) - sight->ox + 1;
+  sight->height = clamp(aty + radius, 0, level->height - 1) - sight->oy + 1;
+  //log_d("Sight dimensions: %d x %d", sight->width, sight->height);
+
+  memset(sight->tiles, 0, bitset_words(sight->width * sight->height) * sizeof(uint32_t));
+
+  sight_set(sight, atx, aty);
+  for (int i = 0; i < 8; ++i) {
+    cast_light(level, sight, OCTANTS[i], atx, aty, radius, 1, 1.0, 0.0);
+  }
+
+  sight->cx = atx;
+  sight->cy = aty;
+  sight->version = level->version;
+
+  timer_stop(TIMER_SIGHT, started);
+}
+
+
+// Recomputes what the actor sees if it has changed tile or the level has
+// changed since the last time. Returns true if it did.
+bool update_sight (Sight* const sight, const Level* level, const Actor* actor) {
+  const int atx = tc(actor->x);
+  const int aty = tc(actor->y);
+
+  if (atx == sight->cx && aty == sight->cy && level->version == sight->version) {
+    return false;
+  }
+
+  compute_sight(sight, level, atx, aty);
+  return true;
+}
+
+
+// The scene the game starts in, which recordings are replayed against
+static const char* const DEMO_LEVEL = "level.lev";
 
-bool should_give_up (int frame, const Actor* actor) {
-  return actor->give_up_at >= 0 && actor->give_up_at <= frame;
+
+void add_demo_actors (Actor* const player, ActorList* const actors, const int radius) {
+  init_actor(player, pc(1), pc(1), 0, radius);
+
+  add_actor(actors, pc(15), pc(10), 180, radius);
+
+  for (int i = 0; i < 5; ++i) {
+    add_actor(actors, pc(16), pc(10), 90, radius);
+  }
 }
 
 
-void return_to_base (Actor* actor) {
-  actor->tx = actor->base_x;
-  actor->ty = actor->base_y;
-  actor->t_angle = actor->base_angle;
-  actor->give_up_at = -1;
+// The actions of every game step, stored as runs of steps with the same
+// actions held. Each run is two bytes: the action bits and its length - 1.
+typedef struct {
+  FILE* file;
+  uint8_t held; // Action bits of the current run
+  int run;      // Steps so far in the run when recording, left when replaying
+} Recording;
+
+static const char RECORDING_MAGIC[4] = { 'T', 'R', 'E', 'C' };
+static const uint8_t RECORDING_VERSION = 1;
+static const int MAX_RUN = 256;
+
+
+uint8_t pack_actions (const bool actions[]) {
+  uint8_t held = 0;
+  for (int i = 0; i < ACTION_COUNT; ++i) {
+    held |= actions[i] << i;
+  }
+  return held;
 }
 
 
-bool has_target (const Actor* actor) {
-  return actor->tx != -1 && actor->ty != -1;
+void unpack_actions (const uint8_t held, bool actions[]) {
+  for (int i = 0; i < ACTION_COUNT; ++i) {
+    actions[i] = held & (1 << i);
+  }
 }
 
 
-bool is_chasing (const Actor* actor) {
-  return has_target(actor) && (actor->tx != actor->base_x || actor->ty != actor->base_y);
+bool start_recording (Recording* const recording, const char* filename) {
+  assert(ACTION_COUNT <= 8);
+
+  recording->file = fopen(filename, "wb");
+  recording->held = 0;
+  recording->run = 0;
+  if (recording->file == NULL) {
+    log_e("Could not open %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  const uint8_t header[] = {
+    RECORDING_MAGIC[0], RECORDING_MAGIC[1], RECORDING_MAGIC[2], RECORDING_MAGIC[3],
+    RECORDING_VERSION, ACTION_COUNT
+  };
+  if (fwrite(header, sizeof(header), 1, recording->file) != 1) {
+    log_e("Could not write %s: %s", filename, strerror(errno));
+    fclose(recording->file);
+    recording->file = NULL;
+    return false;
+  }
+  return true;
 }
 
 
-void move_actors (int frame, MarkList* mark_list, const ActorList* actor_list, const Level* level, const Actor* player) {
-  const int px = player->x;
-  const int py = player->y;
+void write_run (Recording* const recording) {
+  if (recording->run > 0) {
+    fputc(recording->held, recording->file);
+    fputc(recording->run - 1, recording->file);
+  }
+}
+
 
-  for (int i = 0; i < actor_list->len; ++i) {
-    Actor* const actor = &actor_list->actors[i];
+void record_actions (Recording* const recording, const bool actions[]) {
+  const uint8_t held = pack_actions(actions);
+  if (held == recording->held && recording->run > 0 && recording->run < MAX_RUN) {
+    ++recording->run;
+    return;
+  }
 
-    const int ax = actor->x;
-    const int ay = actor->y;
+  write_run(recording);
+  recording->held = held;
+  recording->run = 1;
+}
 
-    // Vector from actor to player
-    const double dx = px - ax;
-    const double dy = py - ay;
 
-    int diff = angle_vector_diff(actor->angle, dx, dy);
-    const bool los = abs(diff) < ACTOR_FOV / 2.0 && line_of_sight(mark_list, level, tc(ax), tc(ay), tc(px), tc(py));
-    if (los) {
-      mark(mark_list, MARK_ACTOR_SPOTTED, ax, ay - actor->radius);
-      actor->tx = px;
-      actor->ty = py;
-      actor->give_up_at = -1;
+void stop_recording (Recording* const recording) {
+  write_run(recording);
+  if (fclose(recording->file) != 0) {
+    log_e("Could not write recording: %s", strerror(errno));
+  }
+  recording->file = NULL;
+}
+
+
+bool start_replay (Recording* const recording, const char* filename) {
+  recording->file = fopen(filename, "rb");
+  recording->held = 0;
+  recording->run = 0;
+  if (recording->file == NULL) {
+    log_e("Could not open %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  uint8_t header[6];
+  if (fread(header, sizeof(header), 1, recording->file) != 1 ||
+      memcmp(header, RECORDING_MAGIC, sizeof(RECORDING_MAGIC)) != 0 ||
+      header[4] != RECORDING_VERSION || header[5] != ACTION_COUNT) {
+    log_e("%s is not a recording of this version", filename);
+    fclose(recording->file);
+    recording->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+
+// Sets actions to those of the next recorded step, false once there are
+// no more
+bool replay_actions (Recording* const recording, bool actions[]) {
+  if (recording->run == 0) {
+    const int held = fgetc(recording->file);
+    const int run = fgetc(recording->file);
+    if (held == EOF || run == EOF) {
+      return false;
     }
+    recording->held = held;
+    recording->run = run + 1;
+  }
 
-    if (actor->give_up_at != -1) {
-      mark(mark_list, MARK_ACTOR_LOST, ax, ay - actor->radius);
+  --recording->run;
+  unpack_actions(recording->held, actions);
+  return true;
+}
+
+
+void stop_replay (Recording* const recording) {
+  fclose(recording->file);
+  recording->file = NULL;
+}
+
+
+#ifndef HEADLESS
+void print_error (void) {
+  log_e("%s", gluErrorString(glGetError()));
+}
+
+
+// Decodes any PNG into a texture_size x texture_size RGBA image in data,
+// resampling it if it is some other size
+bool load_png (const char* filename, const int texture_size, png_byte* const data) {
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+
+  if (!png_image_begin_read_from_file(&image, filename)) {
+    log_e("Failed to read %s: %s", filename, image.message);
+    return false;
+  }
+
+  // libpng converts palette, grey and 16 bit images for us
+  image.format = PNG_FORMAT_RGBA;
+  const bool native = image.width == (png_uint_32)texture_size &&
+    image.height == (png_uint_32)texture_size;
+  png_byte* const pixels = native ? data : malloc(PNG_IMAGE_SIZE(image));
+  if (pixels == NULL) {
+    log_e("Failed to allocate %s: %s", filename, strerror(errno));
+    png_image_free(&image);
+    return false;
+  }
+
+  if (!png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+    log_e("Failed to decode %s: %s", filename, image.message);
+    if (!native) {
+      free(pixels);
     }
+    return false;
+  }
 
-    if (should_give_up(frame, actor)) {
-      return_to_base(actor);
+  if (!native) {
+    log_d("Scaling %s from %u x %u to %d x %d", filename,
+        (unsigned)image.width, (unsigned)image.height, texture_size, texture_size);
+    for (int y = 0; y < texture_size; ++y) {
+      const size_t sy = (size_t)y * image.height / texture_size;
+      for (int x = 0; x < texture_size; ++x) {
+        const size_t sx = (size_t)x * image.width / texture_size;
+        memcpy(&data[((size_t)y * texture_size + x) * 4], &pixels[(sy * image.width + sx) * 4], 4);
+      }
     }
+    free(pixels);
+  }
+
+  return true;
+}
+
+
+// A sprite image while the atlas is being built
+typedef struct {
+  const char* filename;
+  int64_t mtime;
+  int64_t bytes; // File size, -1 if the file is missing
+  png_byte* pixels;
+  bool cached; // Pixels came from the cache
+  bool ok;
+} SpriteImage;
+
+
+typedef struct {
+  SpriteImage* images;
+  int size;
+} SpriteImages;
+
+
+void decode_sprite_job (void* data, int worker, int item) {
+  const SpriteImages* const batch = data;
+  SpriteImage* const image = &batch->images[item];
+  if (!image->cached && image->bytes >= 0) {
+    image->ok = load_png(image->filename, batch->size, image->pixels);
+  }
+}
+
+
+// Decoded sprites are kept here so that warm starts skip libpng. An entry
+// is used only while its PNG keeps the same name, size and mtime.
+static const char* const SPRITE_CACHE = "sprites.cache";
+static const char SPRITE_CACHE_MAGIC[4] = { 'S', 'P', 'R', 'C' };
+static const uint32_t SPRITE_CACHE_VERSION = 1;
+
+#define SPRITE_NAME 64
 
-    if (actor->tx >= 0 && actor->ty >= 0) {
-      const bool found = seek_target(mark_list, level,
-          actor, actor->tx, actor->ty, actor->radius + (los ? player->radius : 0));
-      if (found) {
-        if (actor->tx != actor->base_x && actor->ty != actor->base_y) {
-          actor->give_up_at = frame + 60;
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t size;
+  uint32_t count;
+} SpriteCacheHeader;
+
+// Followed by the sprite's size x size RGBA pixels
+typedef struct {
+  char name[SPRITE_NAME];
+  int64_t mtime;
+  int64_t bytes;
+} SpriteCacheEntry;
+
+
+bool cacheable (const SpriteImage* image) {
+  return image->bytes >= 0 && strlen(image->filename) < SPRITE_NAME;
+}
+
+
+void read_sprite_cache (SpriteImage* const images, const int count, const int size) {
+  FILE* file = fopen(SPRITE_CACHE, "rb");
+  if (file == NULL) {
+    return;
+  }
+
+  const size_t pixel_bytes = (size_t)size * size * 4;
+
+  SpriteCacheHeader header;
+  if (fread(&header, sizeof(header), 1, file) == 1 &&
+      memcmp(header.magic, SPRITE_CACHE_MAGIC, sizeof(SPRITE_CACHE_MAGIC)) == 0 &&
+      header.version == SPRITE_CACHE_VERSION && header.size == (uint32_t)size) {
+    SpriteCacheEntry entry;
+    for (uint32_t n = 0; n < header.count && fread(&entry, sizeof(entry), 1, file) == 1; ++n) {
+      entry.name[SPRITE_NAME - 1] = '\0';
+
+      SpriteImage* image = NULL;
+      for (int i = 0; i < count; ++i) {
+        if (!images[i].cached && cacheable(&images[i]) && strcmp(images[i].filename, entry.name) == 0 &&
+            images[i].mtime == entry.mtime && images[i].bytes == entry.bytes) {
+          image = &images[i];
+          break;
         }
-        actor->tx = -1;
-        actor->ty = -1;
       }
-    }
 
-    if (actor->tx == -1 && actor->ty == -1 && actor->t_angle != -1) {
-      const int ad = angle_diff(actor->angle, actor->t_angle);
-      if (ad == 0) {
-        actor->t_angle = -1;
+      if (image == NULL) {
+        if (fseek(file, pixel_bytes, SEEK_CUR) != 0) {
+          break;
+        }
       }
-      turn(actor, clamp(ad, -ACTOR_TURN, ACTOR_TURN));
+      else if (fread(image->pixels, pixel_bytes, 1, file) == 1) {
+        image->cached = true;
+        image->ok = true;
+      }
+    }
+  }
+
+  fclose(file);
+}
+
+
+void write_sprite_cache (const SpriteImage* const images, const int count, const int size) {
+  FILE* file = fopen(SPRITE_CACHE, "wb");
+  if (file == NULL) {
+    log_e("Could not open %s: %s", SPRITE_CACHE, strerror(errno));
+    return;
+  }
+
+  SpriteCacheHeader header;
+  memcpy(header.magic, SPRITE_CACHE_MAGIC, sizeof(SPRITE_CACHE_MAGIC));
+  header.version = SPRITE_CACHE_VERSION;
+  header.size = size;
+  header.count = 0;
+  for (int i = 0; i < count; ++i) {
+    header.count += images[i].ok && cacheable(&images[i]);
+  }
+
+  const size_t pixel_bytes = (size_t)size * size * 4;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (int i = 0; ok && i < count; ++i) {
+    if (!images[i].ok || !cacheable(&images[i])) {
+      continue;
     }
 
-    if (!los && is_chasing(actor)) {
-      mark(mark_list, MARK_ACTOR_CHASING, ax, ay - actor->radius);
+    SpriteCacheEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    strcpy(entry.name, images[i].filename);
+    entry.mtime = images[i].mtime;
+    entry.bytes = images[i].bytes;
+    ok = fwrite(&entry, sizeof(entry), 1, file) == 1 &&
+      fwrite(images[i].pixels, pixel_bytes, 1, file) == 1;
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    log_e("Could not write %s: %s", SPRITE_CACHE, strerror(errno));
+    remove(SPRITE_CACHE);
+  }
+}
+
+
+// Fills in one size x size image per file, from the cache where it is
+// still valid and by decoding the PNGs on the pool otherwise
+void load_sprite_images (WorkerPool* const pool, const char* const filenames[], const int count,
+    const int size, SpriteImage* const images, png_byte* const pixels) {
+  for (int i = 0; i < count; ++i) {
+    SpriteImage* const image = &images[i];
+    image->filename = filenames[i];
+    image->pixels = &pixels[(size_t)i * size * size * 4];
+    image->cached = false;
+    image->ok = false;
+
+    struct stat st;
+    if (stat(filenames[i], &st) == 0) {
+      image->mtime = st.st_mtime;
+      image->bytes = st.st_size;
+    }
+    else {
+      log_e("Failed to open %s: %s", filenames[i], strerror(errno));
+      image->mtime = 0;
+      image->bytes = -1;
     }
   }
+
+  read_sprite_cache(images, count, size);
+
+  int decoded = 0;
+  for (int i = 0; i < count; ++i) {
+    decoded += !images[i].cached && images[i].bytes >= 0;
+  }
+  if (decoded == 0) {
+    return;
+  }
+
+  SpriteImages batch = { images, size };
+  run_parallel(pool, count, 1, decode_sprite_job, &batch);
+  log_d("Decoded %d of %d sprites", decoded, count);
+
+  write_sprite_cache(images, count, size);
 }
 
 
-void game (int frame, const Level* level, MarkList* const mark_list, Actor* const player, const bool actions[], const ActorList actors) {
-  const int PLAYER_TURN = 6;
-  const int PLAYER_STEP = 400;
+// Texture coordinates of a sprite in the atlas
+typedef struct {
+  GLfloat u0;
+  GLfloat v0;
+  GLfloat u1;
+  GLfloat v1;
+  bool loaded;
+} Sprite;
 
-  if (actions[LEFT] | actions[RIGHT]) {
-    turn(player, actions[LEFT] ? PLAYER_TURN : -PLAYER_TURN);
+
+// All sprites packed into one texture. Every sprite has a border of
+// ATLAS_PADDING copies of its edge texels so that linear filtering doesn't
+// pick up its neighbours.
+typedef struct {
+  GLuint texture;
+  int width;
+  int height;
+  int count;
+  Sprite* sprites;
+} Atlas;
+
+
+static const int ATLAS_PADDING = 1;
+
+
+int next_pow2 (int n) {
+  int p = 1;
+  while (p < n) {
+    p *= 2;
   }
-  if (actions[FORWARD] || actions[BACKWARD]) {
-    const int step = actions[FORWARD] ? PLAYER_STEP : -PLAYER_STEP;
-    move(player, step);
+  return p;
+}
+
+
+void free_atlas (Atlas* const atlas) {
+  if (atlas != NULL) {
+    glDeleteTextures(1, &atlas->texture);
+    free(atlas->sprites);
+    free(atlas);
   }
+}
 
-  move_actors(frame, mark_list, &actors, level, player);
 
-  check_tiles(level);
+// Sprites are decoded on the pool; only the upload happens on the calling
+// thread, as one glTexImage2D
+Atlas* new_atlas (WorkerPool* const pool, const char* const filenames[], const int count, const int sprite_size) {
+  const int cell = sprite_size + 2 * ATLAS_PADDING;
 
-  bool moved = false;
-  static const int tries = 10;
-  int i = 0;
-  do {
-    if (i == tries) {
-      /* log_e("Collision state still unsettled after %d tries, giving up!", */
-      /*     tries); */
-      break;
+  int columns = 1;
+  while (columns * columns < count) {
+    ++columns;
+  }
+  const int rows = (count + columns - 1) / columns;
+
+  Atlas* const atlas = malloc(sizeof(Atlas));
+  if (atlas == NULL) {
+    log_e("Failed to allocate Atlas: %s", strerror(errno));
+    return NULL;
+  }
+
+  atlas->width = next_pow2(columns * cell);
+  atlas->height = next_pow2(rows * cell);
+  atlas->count = count;
+  atlas->texture = NULL_TEXTURE;
+  atlas->sprites = calloc(count, sizeof(Sprite));
+
+  png_byte* const pixels = calloc((size_t)atlas->width * atlas->height, 4);
+  png_byte* const sprites = malloc((size_t)count * sprite_size * sprite_size * 4);
+  SpriteImage* const images = malloc(count * sizeof(SpriteImage));
+  if (atlas->sprites == NULL || pixels == NULL || sprites == NULL || images == NULL) {
+    log_e("Failed to allocate atlas: %s", strerror(errno));
+    free(pixels);
+    free(sprites);
+    free(images);
+    free_atlas(atlas);
+    return NULL;
+  }
+
+  load_sprite_images(pool, filenames, count, sprite_size, images, sprites);
+
+  for (int i = 0; i < count; ++i) {
+    if (!images[i].ok) {
+      continue;
     }
-    ++i;
-    moved = collide_level_actor(mark_list, level, player);
-    for (int i = 0; i < actors.len; ++i) {
-      if (collide_level_actor(mark_list, level, &actors.actors[i])) {
-        moved = true;
+    const png_byte* const sprite = images[i].pixels;
+
+    const int ox = (i % columns) * cell;
+    const int oy = (i / columns) * cell;
+    for (int y = 0; y < cell; ++y) {
+      const int sy = clamp(y - ATLAS_PADDING, 0, sprite_size - 1);
+      for (int x = 0; x < cell; ++x) {
+        const int sx = clamp(x - ATLAS_PADDING, 0, sprite_size - 1);
+        memcpy(&pixels[((size_t)(oy + y) * atlas->width + ox + x) * 4],
+            &sprite[((size_t)sy * sprite_size + sx) * 4], 4);
       }
     }
 
-    for (int i = 0; i < actors.len; ++i) {
-      if (collide_actor_actor(player, &actors.actors[i])) {
-        moved = true;
-      }
-    }
+    Sprite* const s = &atlas->sprites[i];
+    s->u0 = (GLfloat)(ox + ATLAS_PADDING) / atlas->width;
+    s->v0 = (GLfloat)(oy + ATLAS_PADDING) / atlas->height;
+    s->u1 = (GLfloat)(ox + ATLAS_PADDING + sprite_size) / atlas->width;
+    s->v1 = (GLfloat)(oy + ATLAS_PADDING + sprite_size) / atlas->height;
+    s->loaded = true;
+  }
 
-    for (int i = 0; i < actors.len; ++i) {
-      for (int j = i + 1; j < actors.len; ++j) {
-        if (collide_actor_actor(&actors.actors[i], &actors.actors[j])) {
-          moved = true;
-        }
-      }
-    }
-  } while (moved);
+  glGenTextures(1, &atlas->texture);
+  glBindTexture(GL_TEXTURE_2D, atlas->texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas->width, atlas->height, 0,
+      GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  //print_error();
 
-  const int tx = tc(player->x);
-  const int ty = tc(player->y);
+  free(images);
+  free(sprites);
+  free(pixels);
+
+  return atlas;
+}
 
-  tile_at(level, tx, ty)->occupied = true;
 
-  for (int i = 0; i < actors.len; ++i) {
-    const int ax = tc(actors.actors[i].x);
-    const int ay = tc(actors.actors[i].y);
-    tile_at(level, ax, ay)->occupied = true;
+typedef struct {
+  GLfloat x;
+  GLfloat y;
+  GLfloat u;
+  GLfloat v;
+} Vertex;
+
+
+// Writes the corners of a TEXTURE_SIZE sprite centered on (x, y) in level
+// coordinates, rotated by angle degrees
+void sprite_quad (Vertex quad[4], const Sprite* sprite, const int x, const int y, const int angle) {
+  static const GLfloat corners[4][2] = {
+    {  .5,  .5 },
+    {  .5, -.5 },
+    { -.5, -.5 },
+    { -.5,  .5 },
+  };
+
+  const double a = angle / 180.0 * M_PI;
+  const double c = cos(a);
+  const double s = sin(a);
+
+  for (int i = 0; i < 4; ++i) {
+    const double cx = corners[i][0] * TEXTURE_SIZE;
+    const double cy = corners[i][1] * TEXTURE_SIZE;
+    quad[i].x = x / (double)COORD_PREC + cx * c + cy * s;
+    quad[i].y = y / (double)COORD_PREC - cx * s + cy * c;
+    quad[i].u = corners[i][0] < 0 ? sprite->u0 : sprite->u1;
+    quad[i].v = corners[i][1] < 0 ? sprite->v0 : sprite->v1;
   }
+}
 
-  const double a = player->angle / 180.0 * M_PI;
 
-  double fr = player->radius;
-  int fx;
-  int fy;
+// Sprites streamed to the GPU, drawn with one call per flush
+typedef struct {
+  Vertex* vertices;
+  int len; // Quads
+  int max;
+  GLuint texture;
+  GLuint buffer;
+} SpriteBatch;
 
-  do {
-    fr += TILE_SIZE / 2;
-    fx = tc(player->x + fr * cos(a));
-    fy = tc(player->y - fr * sin(a));
+
+bool init_sprite_batch (SpriteBatch* const batch, const Atlas* atlas, const int max) {
+  batch->vertices = malloc(4 * max * sizeof(Vertex));
+  if (batch->vertices == NULL) {
+    log_e("Failed to allocate sprite batch: %s", strerror(errno));
+    return false;
   }
-  while (fx == tx && fy == ty);
-  if (can_be_activated(level, fx, fy)) {
-    if (actions[ACTIVATE]) {
-      Tile* tile = tile_at(level, fx, fy);
-      tile->flips_in = tile->activation_time;
-      log_d("Tile (%d, %d) is now %s", fx, fy, tile->active ? "deactivating" : "activating");
-    }
-    else {
-      mark(mark_list, MARK_TILE_PLAYER_FACING, fx, fy);
-    }
+  batch->len = 0;
+  batch->max = max;
+  batch->texture = atlas->texture;
+  glGenBuffers(1, &batch->buffer);
+  return true;
+}
+
+
+void free_sprite_batch (SpriteBatch* const batch) {
+  glDeleteBuffers(1, &batch->buffer);
+  free(batch->vertices);
+}
+
+
+void flush_sprites (SpriteBatch* const batch) {
+  if (batch->len == 0) {
+    return;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, batch->texture);
+  glBindBuffer(GL_ARRAY_BUFFER, batch->buffer);
+  glBufferData(GL_ARRAY_BUFFER, 4 * batch->len * sizeof(Vertex), batch->vertices, GL_STREAM_DRAW);
+  glVertexPointer(2, GL_FLOAT, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, x));
+  glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, u));
+  glDrawArrays(GL_QUADS, 0, 4 * batch->len);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  counter_add(COUNTER_DRAW_CALLS, 1);
+  batch->len = 0;
+}
+
+
+void draw_texture (SpriteBatch* const batch, const Sprite* sprite, const int x, const int y, const int angle) {
+  if (!sprite->loaded) {
+    return;
+  }
+
+  if (batch->len == batch->max) {
+    flush_sprites(batch);
+  }
+
+  sprite_quad(&batch->vertices[4 * batch->len++], sprite, x, y, angle);
+}
+
+
+void draw_tile (SpriteBatch* const batch, const Sprite* sprite, const int x, const int y) {
+  draw_texture(batch, sprite, pc(x), pc(y), 0);
+}
+
+
+// Static buffer with a quad per tile, textured from the atlas so the whole
+// layer is one draw call. Only doors change sprite, and a flipped door has
+// just its own quad rewritten.
+typedef struct {
+  GLuint vertices;
+  int size;
+  GLint* firsts;  // Visible run of each row
+  GLsizei* counts;
+  int* codes;     // Code each tile is drawn with
+  int* doors;     // Tiles that can change code
+  int door_count;
+  unsigned int version; // Level version drawn
+} TileLayer;
+
+
+int tile_code (const Level* level, const int i) {
+  return TILE_TYPES[level->types[i]].code + (bit_get(level->active_bits, i) ? 1 : 0);
+}
+
+
+void free_tile_layer (TileLayer* const layer) {
+  if (layer != NULL) {
+    glDeleteBuffers(1, &layer->vertices);
+    free(layer->firsts);
+    free(layer->counts);
+    free(layer->codes);
+    free(layer->doors);
+    free(layer);
+  }
+}
+
+
+TileLayer* new_tile_layer (const Level* level, const Atlas* atlas, const int tile_sprites[]) {
+  const int size = level->width * level->height;
+
+  TileLayer* const layer = calloc(1, sizeof(TileLayer));
+  if (layer == NULL) {
+    log_e("Failed to allocate TileLayer: %s", strerror(errno));
+    return NULL;
+  }
+
+  layer->size = size;
+  layer->firsts = malloc(level->height * sizeof(GLint));
+  layer->counts = malloc(level->height * sizeof(GLsizei));
+  layer->codes = malloc(size * sizeof(int));
+  layer->doors = malloc(size * sizeof(int));
+  Vertex* const vertices = malloc(4 * size * sizeof(Vertex));
+  if (!layer->firsts || !layer->counts || !layer->codes || !layer->doors || !vertices) {
+    log_e("Failed to allocate tile layer: %s", strerror(errno));
+    free(vertices);
+    free_tile_layer(layer);
+    return NULL;
   }
-}
 
+  layer->door_count = 0;
+  for (int i = 0; i < size; ++i) {
+    const int x = i % level->width;
+    const int y = i / level->width;
+    const int code = tile_code(level, i);
+    layer->codes[i] = code;
+    if (TILE_TYPES[level->types[i]].activation_time >= 0) {
+      layer->doors[layer->door_count++] = i;
+    }
+    sprite_quad(&vertices[4 * i], &atlas->sprites[tile_sprites[code]], pc(x), pc(y), 0);
+  }
 
-typedef struct {
-  int ox;
-  int oy;
-  int width;
-  int height;
-  bool* tiles;
-} Sight;
+  glGenBuffers(1, &layer->vertices);
+  glBindBuffer(GL_ARRAY_BUFFER, layer->vertices);
+  glBufferData(GL_ARRAY_BUFFER, 4 * size * sizeof(Vertex), vertices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  free(vertices);
 
+  layer->version = level->version;
 
-void free_sight (Sight* const sight) {
-  free(sight->tiles);
-  free(sight);
+  return layer;
 }
 
 
-void sight_set (Sight* const sight, int x, int y) {
-  const int sx = x - sight->ox;
-  const int sy = y - sight->oy;
-  assert(sx >= 0);
-  assert(sy >= 0);
-  assert(sx < sight->width);
-  assert(sy < sight->height);
-  sight->tiles[sy * sight->width + sx] = true;
-}
+// Rewrites the quads of doors that have flipped since the last call
+void update_tile_layer (TileLayer* const layer, const Level* level,
+    const Atlas* atlas, const int tile_sprites[]) {
+  if (layer->version == level->version) {
+    return;
+  }
 
+  glBindBuffer(GL_ARRAY_BUFFER, layer->vertices);
+  for (int d = 0; d < layer->door_count; ++d) {
+    const int i = layer->doors[d];
+    const int code = tile_code(level, i);
+    if (code == layer->codes[i]) {
+      continue;
+    }
 
-bool sight_get (const Sight* const sight, int x, int y) {
-  const int sx = x - sight->ox;
-  const int sy = y - sight->oy;
-  if (sx < 0 || sy < 0 || sx >= sight->width || sy >= sight->height) {
-    return false;
+    Vertex quad[4];
+    sprite_quad(quad, &atlas->sprites[tile_sprites[code]],
+        pc(i % level->width), pc(i / level->width), 0);
+    glBufferSubData(GL_ARRAY_BUFFER, 4 * i * sizeof(Vertex), sizeof(quad), quad);
+    layer->codes[i] = code;
   }
-  return sight->tiles[sy * sight->width + sx] ||
-    ((sx == 0 ||  sight->tiles[sy * sight->width + sx - 1]) &&
-     (sx == sight->width - 1 || sight->tiles[sy * sight->width + sx + 1]) &&
-     (sy == 0 || sight->tiles[(sy - 1) * sight->width + sx]) &&
-     (sy == sight->width - 1 || sight->tiles[sy * sight->width + sx - 1]));
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  layer->version = level->version;
 }
 
 
-bool sight_callback (int x, int y, const void* in, void* out) {
-  Sight* sight = out;
-  const Level* level = in;
+// Darkness over the tiles out of sight, as an alpha texture with a texel
+// per tile drawn in one quad over the level. Only the tiles the last and
+// the current sight cover can change, so just that rectangle is uploaded.
+typedef struct {
+  GLuint texture;
+  int width;  // Level dimensions
+  int height;
+  GLfloat u;  // Texture coordinates of the level's far corner
+  GLfloat v;
+  uint8_t* texels;
+  int ox;     // Sight drawn, Sight offset and dimensions
+  int oy;
+  int sight_w;
+  int sight_h;
+} FogLayer;
+
+
+static const GLubyte FOG_ALPHA = 115;
+static const GLfloat FOG_COLOR[3] = { 0.0, 0.07, 0.5 };
 
-  sight_set(sight, x, y);
 
-  return see_through(level, x, y);
+void free_fog_layer (FogLayer* const fog) {
+  if (fog != NULL) {
+    glDeleteTextures(1, &fog->texture);
+    free(fog->texels);
+    free(fog);
+  }
 }
 
 
-Sight* compute_sight (const Level level, const Actor actor, int radius) {
-  Sight* sight = malloc(sizeof(Sight));;
-  if (sight == NULL) {
-    log_e("Failed to allocate Sight: %s", strerror(errno));
+FogLayer* new_fog_layer (const Level* level) {
+  FogLayer* const fog = calloc(1, sizeof(FogLayer));
+  if (fog == NULL) {
+    log_e("Failed to allocate FogLayer: %s", strerror(errno));
     return NULL;
   }
 
-  const int atx = tc(actor.x);
-  const int aty = tc(actor.y);
+  const int tex_w = next_pow2(level->width);
+  const int tex_h = next_pow2(level->height);
+
+  fog->texture = NULL_TEXTURE;
+  fog->width = level->width;
+  fog->height = level->height;
+  fog->u = (GLfloat)level->width / tex_w;
+  fog->v = (GLfloat)level->height / tex_h;
+  fog->texels = malloc((size_t)tex_w * tex_h);
+  if (fog->texels == NULL) {
+    log_e("Failed to allocate fog texels: %s", strerror(errno));
+    free_fog_layer(fog);
+    return NULL;
+  }
+  memset(fog->texels, FOG_ALPHA, (size_t)tex_w * tex_h);
+
+  glGenTextures(1, &fog->texture);
+  glBindTexture(GL_TEXTURE_2D, fog->texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, tex_w, tex_h, 0,
+      GL_ALPHA, GL_UNSIGNED_BYTE, fog->texels);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  return fog;
+}
 
-  // Offset (top left tile)
-  sight->ox = clamp(atx - radius, 0, level.width - 1);
-  sight->oy = clamp(aty - radius, 0, level.height - 1);
-  //log_d("Sight offset: (%d, %d)", sight->ox, sight->oy);
 
-  // Table dimensions
-  // Example: radius 1
-  // ...
-  // .@.
-  // ...
-  const int side = (radius + 1) * (radius + 1);
+// Darkens what the last sight lit and lights what this one sees, then
+// uploads the rectangle covering both
+void update_fog_layer (FogLayer* const fog, const Sight* sight) {
+  const int w = fog->width;
 
-  sight->width = clamp(side, 1, level.width - sight->ox);
-  sight->height = clamp(side, 1, level.height - sight->oy);
-  //log_d("Sight dimensions: %d x %d", sight->width, sight->height);
+  for (int y = fog->oy; y < fog->oy + fog->sight_h; ++y) {
+    memset(&fog->texels[y * w + fog->ox], FOG_ALPHA, fog->sight_w);
+  }
+  for (int y = sight->oy; y < sight->oy + sight->height; ++y) {
+    for (int x = sight->ox; x < sight->ox + sight->width; ++x) {
+      if (sight_get(sight, x, y)) {
+        fog->texels[y * w + x] = 0;
+      }
+    }
+  }
 
-  sight->tiles = calloc(sight->width * sight->height, sizeof(bool));
-  if (sight->tiles == NULL) {
-    log_e("Failed to allocate sight table: %s", strerror(errno));
-    free(sight);
-    return NULL;
+  int x1 = sight->ox;
+  int y1 = sight->oy;
+  int x2 = sight->ox + sight->width;
+  int y2 = sight->oy + sight->height;
+  if (fog->sight_w > 0) {
+    x1 = fog->ox < x1 ? fog->ox : x1;
+    y1 = fog->oy < y1 ? fog->oy : y1;
+    x2 = fog->ox + fog->sight_w > x2 ? fog->ox + fog->sight_w : x2;
+    y2 = fog->oy + fog->sight_h > y2 ? fog->oy + fog->sight_h : y2;
   }
 
-  int x = radius;
-  int y = 0;
-  int dx = 1 - radius * 2;
-  int dy = 0;
-  int err = 0;
-
-  while (x >= y) {
-    bresenham(atx, aty, atx + x, aty + y, sight_callback, &level, sight);
-    bresenham(atx, aty, atx + y, aty + x, sight_callback, &level, sight);
-    bresenham(atx, aty, atx - x, aty + y, sight_callback, &level, sight);
-    bresenham(atx, aty, atx - y, aty + x, sight_callback, &level, sight);
-    bresenham(atx, aty, atx - x, aty - y, sight_callback, &level, sight);
-    bresenham(atx, aty, atx - y, aty - x, sight_callback, &level, sight);
-    bresenham(atx, aty, atx + x, aty - y, sight_callback, &level, sight);
-    bresenham(atx, aty, atx + y, aty - x, sight_callback, &level, sight);
-
-    ++y;
-    err += dy;
-    dy += 2;
-    if ((err << 1) + dx > 0) {
-      --x;
-      err += dx;
-      dx += 2;
-    }
+  fog->ox = sight->ox;
+  fog->oy = sight->oy;
+  fog->sight_w = sight->width;
+  fog->sight_h = sight->height;
+
+  if (x1 >= x2 || y1 >= y2) {
+    return;
   }
 
-  return sight;
+  glBindTexture(GL_TEXTURE_2D, fog->texture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x1, y1, x2 - x1, y2 - y1,
+      GL_ALPHA, GL_UNSIGNED_BYTE, &fog->texels[y1 * w + x1]);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
 
 
-void print_error (void) {
-  fprintf(stderr, "Error: %s\n", gluErrorString(glGetError()));
+// With GL_REPLACE an alpha texture keeps the current color, so the quad is
+// drawn in the fog color with each tile's alpha
+void draw_fog_layer (const FogLayer* fog) {
+  const GLfloat x2 = pc_corner(fog->width) / (GLfloat)COORD_PREC;
+  const GLfloat y2 = pc_corner(fog->height) / (GLfloat)COORD_PREC;
+  const Vertex quad[4] = {
+    { 0, 0, 0, 0 },
+    { x2, 0, fog->u, 0 },
+    { x2, y2, fog->u, fog->v },
+    { 0, y2, 0, fog->v },
+  };
+
+  glBindTexture(GL_TEXTURE_2D, fog->texture);
+  glColor3fv(FOG_COLOR);
+  glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &quad[0].x);
+  glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &quad[0].u);
+  glDrawArrays(GL_QUADS, 0, 4);
+  counter_add(COUNTER_DRAW_CALLS, 1);
+  glColor3f(1, 1, 1);
 }
 
 
-GLuint load_texture (const char* filename, const int texture_size) {
-  FILE* file = fopen(filename, "rb");
-  if (file == NULL) {
-    log_e("Failed to open %s: %s", filename, strerror(errno));
-    return NULL_TEXTURE;
-  }
+// View into the level. (x, y) is the top left corner in level coordinates
+// and (tx1, ty1) - (tx2, ty2) the tiles at least partly on screen.
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+  int tx1;
+  int ty1;
+  int tx2;
+  int ty2;
+} Camera;
+
+
+void init_camera (Camera* const camera, const int win_w, const int win_h) {
+  camera->x = 0;
+  camera->y = 0;
+  camera->w = win_w * COORD_PREC;
+  camera->h = win_h * COORD_PREC;
+  camera->tx1 = camera->ty1 = 0;
+  camera->tx2 = camera->ty2 = -1;
+}
 
-  static const int HEADER_SIZE = 8;
 
-  png_byte header[HEADER_SIZE];
-  fread(header, sizeof(png_byte), HEADER_SIZE, file);
+// Keeps pos centered while staying inside 0 - size. A level smaller than
+// the view is centered instead.
+int camera_axis (const int pos, const int view, const int size) {
+  if (size <= view) {
+    return (size - view) / 2;
+  }
+  return clamp(pos - view / 2, 0, size - view);
+}
 
-  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
-      NULL, NULL, NULL);
 
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  png_infop end_info_ptr = png_create_info_struct(png_ptr);
+void camera_follow (Camera* const camera, const Level* level, const int x, const int y) {
+  camera->x = camera_axis(x, camera->w, pc_corner(level->width));
+  camera->y = camera_axis(y, camera->h, pc_corner(level->height));
 
-  png_init_io(png_ptr, file);
-  png_set_sig_bytes(png_ptr, HEADER_SIZE);
-  png_read_info(png_ptr, info_ptr);
+  camera->tx1 = clamp(tc(camera->x), 0, level->width - 1);
+  camera->ty1 = clamp(tc(camera->y), 0, level->height - 1);
+  camera->tx2 = clamp(tc(camera->x + camera->w - 1), 0, level->width - 1);
+  camera->ty2 = clamp(tc(camera->y + camera->h - 1), 0, level->height - 1);
+}
 
-  const size_t row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-  png_byte data[texture_size * row_bytes];
-  for (int row = 0; row < texture_size; ++row) {
-    png_read_row(png_ptr, data + row * row_bytes, NULL);
-  }
 
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_size, texture_size, 0,
-      GL_RGBA, GL_UNSIGNED_BYTE, data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  //print_error();
-  png_destroy_read_struct(&png_ptr, &info_ptr, &end_info_ptr);
+// Position alpha of the way from the last step to the current one
+int interpolate (const int from, const int to, const double alpha) {
+  return from + (int)((to - from) * alpha);
+}
 
-  fclose(file);
 
-  return texture;
+// True if a sprite centered on (x, y) can reach the screen. Allows one tile
+// for the sprite itself and anything drawn over it.
+bool camera_sees (const Camera* camera, const int x, const int y) {
+  return x >= camera->x - TILE_SIZE && x < camera->x + camera->w + TILE_SIZE &&
+    y >= camera->y - TILE_SIZE && y < camera->y + camera->h + TILE_SIZE;
 }
 
 
-void draw_texture (const int texture, const int x, const int y, const int angle, const bool center) {
-  glBindTexture(GL_TEXTURE_2D, texture);
+void draw_level (TileLayer* const layer, const Level* level, const Camera* camera,
+    const Atlas* atlas, const int tile_sprites[]) {
+  const int64_t started = clock_ns();
+  update_tile_layer(layer, level, atlas, tile_sprites);
 
-  glLoadIdentity();
-  glTranslated(x / (double)COORD_PREC, y / (double)COORD_PREC, 0.0);
-  glRotated(angle, 0.0, 0.0, -1.0);
+  // One run of quads per visible row
+  int rows = 0;
+  for (int y = camera->ty1; y <= camera->ty2; ++y) {
+    layer->firsts[rows] = 4 * tile_index(level, camera->tx1, y);
+    layer->counts[rows] = 4 * (camera->tx2 - camera->tx1 + 1);
+    ++rows;
+  }
+  if (rows == 0) {
+    timer_stop(TIMER_DRAW, started);
+    return;
+  }
 
-  glScaled(TEXTURE_SIZE, TEXTURE_SIZE, 1);
+  glBindTexture(GL_TEXTURE_2D, atlas->texture);
+  glBindBuffer(GL_ARRAY_BUFFER, layer->vertices);
+  glVertexPointer(2, GL_FLOAT, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, x));
+  glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, u));
+  glMultiDrawArrays(GL_QUADS, layer->firsts, layer->counts, rows);
+  counter_add(COUNTER_DRAW_CALLS, 1);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-  if (!center) {
-    glTranslated(0.5, 0.5, 0);
-  }
+  timer_stop(TIMER_DRAW, started);
+}
 
-  glBegin(GL_QUADS);
 
-  glTexCoord2d(1.0, 1.0);
-  glVertex2d(.5, .5);
+// Rolling averages as bars in the top left corner: green for timers, at
+// HUD_PX_PER_MS with a mark at the frame budget, blue for counters on a
+// log scale
+void draw_profile (const Profile* profile, const double budget_ms) {
+  static const int HUD_PX_PER_MS = 12;
+  static const int HUD_ROW = 8;
+  static const int HUD_BAR = 6;
+  static const int HUD_X = 4;
+
+  GLfloat quads[(TIMER_COUNT + COUNTER_COUNT + 1) * 8];
+  int n = 0;
+
+  for (int r = 0; r < TIMER_COUNT + COUNTER_COUNT; ++r) {
+    const double w = r < TIMER_COUNT ?
+      profile_ms(profile, r) * HUD_PX_PER_MS :
+      16 * log2(1 + profile_count(profile, r - TIMER_COUNT));
+    const GLfloat y = HUD_X + r * HUD_ROW;
+    const GLfloat q[8] = {
+      HUD_X, y, HUD_X + w, y, HUD_X + w, y + HUD_BAR, HUD_X, y + HUD_BAR
+    };
+    memcpy(&quads[8 * n++], q, sizeof(q));
+  }
 
-  glTexCoord2d(1.0, 0.0);
-  glVertex2d(.5, -.5);
+  const GLfloat bx = HUD_X + budget_ms * HUD_PX_PER_MS;
+  const GLfloat budget[8] = {
+    bx, HUD_X, bx + 1, HUD_X, bx + 1, HUD_X + TIMER_COUNT * HUD_ROW, bx, HUD_X + TIMER_COUNT * HUD_ROW
+  };
+  memcpy(&quads[8 * n++], budget, sizeof(budget));
 
-  glTexCoord2d(0.0, 0.0);
-  glVertex2d(-.5, -.5);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glVertexPointer(2, GL_FLOAT, 0, quads);
 
-  glTexCoord2d(0.0, 1.0);
-  glVertex2d(-.5, .5);
+  glColor3f(0.2, 0.7, 0.2);
+  glDrawArrays(GL_QUADS, 0, 4 * TIMER_COUNT);
+  glColor3f(0.2, 0.3, 0.8);
+  glDrawArrays(GL_QUADS, 4 * TIMER_COUNT, 4 * COUNTER_COUNT);
+  glColor3f(0.8, 0.1, 0.1);
+  glDrawArrays(GL_QUADS, 4 * (TIMER_COUNT + COUNTER_COUNT), 4);
 
-  glEnd();
+  glColor3f(1, 1, 1);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
 
-void draw_tile (const int texture, const int x, const int y) {
-  if (texture == NULL_TEXTURE) {
-    log_e("Attempted to draw with NULL_TEXTURE: %d", NULL_TEXTURE);
-    return;
-  }
-  draw_texture(texture, pc(x), pc(y), 0, true);
+void usage (const char* name) {
+  fprintf(stderr, "Usage: %s [-p profile.csv] [-r record.trec | -R replay.trec [-F]]\n", name);
 }
 
 
-void draw_level (const Level level, const GLuint tile_textures[],
-    const GLuint darkness, const Sight* const sight) {
-  int i = 0;
-  for (int y = 0; y < level.height; ++y) {
-    for (int x = 0; x < level.width; ++x) {
-      const int code = level.tiles[i].code + (level.tiles[i].active ? 1 : 0);
-      const GLuint texture = tile_textures[code];
-      draw_tile(texture, x, y); 
-      //if (!sight_get(sight, x, y)) {
-      //  draw_tile(darkness, x, y);
-      //}
-      ++i;
+int main (int argc, char *argv[]) {
+  atexit(flush_log);
+
+  FILE* profile_csv = NULL;
+  const char* record_file = NULL;
+  const char* replay_file = NULL;
+  bool fast_forward = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:r:R:F")) != -1) {
+    switch (opt) {
+      case 'p':
+        profile_csv = fopen(optarg, "w");
+        if (profile_csv == NULL) {
+          log_e("Could not open %s: %s", optarg, strerror(errno));
+          return 1;
+        }
+        break;
+      case 'r':
+        record_file = optarg;
+        break;
+      case 'R':
+        replay_file = optarg;
+        break;
+      case 'F':
+        fast_forward = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
     }
   }
-} 
 
+  // Both would share one Recording, and a replay is not worth recording
+  if (record_file != NULL && replay_file != NULL) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Input comes either from the keyboard, optionally recorded, or from a
+  // recording. Fast forward runs a replay as fast as it goes.
+  Recording recording;
+  if (replay_file != NULL ? !start_replay(&recording, replay_file) :
+      record_file != NULL && !start_recording(&recording, record_file)) {
+    return 1;
+  }
+  fast_forward = fast_forward && replay_file != NULL;
 
-int main (int argc, char *argv[]) {
   SDL_Init(SDL_INIT_VIDEO);
 
   SDL_Event event;
@@ -1374,6 +4608,7 @@ int main (int argc, char *argv[]) {
   const int win_h = 600;
 
   SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+  SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, fast_forward ? 0 : 1);
 
   SDL_Surface* screen = SDL_SetVideoMode(win_w, win_h, 32, SDL_OPENGL);
 
@@ -1389,30 +4624,86 @@ int main (int argc, char *argv[]) {
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
 
-  GLuint tex_player = load_texture("player.png", TEXTURE_SIZE);
-  GLuint tex_actor = load_texture("actor2.png", TEXTURE_SIZE);
-  GLuint tex_mark = load_texture("mark.png", TEXTURE_SIZE);
-  GLuint tex_dot = load_texture("dot.png", TEXTURE_SIZE);
-  GLuint tex_darkness = load_texture("darkness.png", TEXTURE_SIZE);
-  //GLuint tex_actor_sight = load_texture("actor_sight.png", TEXTURE_SIZE);
-  GLuint tex_actor_path = load_texture("actor_path.png", TEXTURE_SIZE);
-  GLuint tex_actor_spotted = load_texture("actor_spotted.png", TEXTURE_SIZE);
-  GLuint tex_actor_chasing = load_texture("actor_chasing.png", TEXTURE_SIZE);
-  GLuint tex_actor_lost = load_texture("actor_lost.png", TEXTURE_SIZE);
-
-  GLuint tile_textures[] = {
-    load_texture("floor.png", TEXTURE_SIZE),
-    load_texture("wall.png", TEXTURE_SIZE),
-    load_texture("door.png", TEXTURE_SIZE),
-    load_texture("door-open.png", TEXTURE_SIZE)
+  enum {
+    SPRITE_FLOOR,
+    SPRITE_WALL,
+    SPRITE_DOOR,
+    SPRITE_DOOR_OPEN,
+    SPRITE_PLAYER,
+    SPRITE_ACTOR,
+    SPRITE_MARK,
+    SPRITE_DOT,
+    SPRITE_ACTOR_PATH,
+    SPRITE_ACTOR_SPOTTED,
+    SPRITE_ACTOR_CHASING,
+    SPRITE_ACTOR_LOST,
+    SPRITE_COUNT
+  };
+
+  const char* const sprite_files[] = {
+    [SPRITE_FLOOR] = "floor.png",
+    [SPRITE_WALL] = "wall.png",
+    [SPRITE_DOOR] = "door.png",
+    [SPRITE_DOOR_OPEN] = "door-open.png",
+    [SPRITE_PLAYER] = "player.png",
+    [SPRITE_ACTOR] = "actor2.png",
+    [SPRITE_MARK] = "mark.png",
+    [SPRITE_DOT] = "dot.png",
+    //[SPRITE_ACTOR_SIGHT] = "actor_sight.png",
+    [SPRITE_ACTOR_PATH] = "actor_path.png",
+    [SPRITE_ACTOR_SPOTTED] = "actor_spotted.png",
+    [SPRITE_ACTOR_CHASING] = "actor_chasing.png",
+    [SPRITE_ACTOR_LOST] = "actor_lost.png",
   };
 
+  WorkerPool* loader = new_worker_pool(0);
+  Atlas* atlas = loader == NULL ? NULL : new_atlas(loader, sprite_files, SPRITE_COUNT, TEXTURE_SIZE);
+  free_worker_pool(loader);
+  if (atlas == NULL) {
+    return 1;
+  }
+  const Sprite* const sprites = atlas->sprites;
+
+  // Sprite of each tile code
+  const int tile_sprites[] = {
+    SPRITE_FLOOR,
+    SPRITE_WALL,
+    SPRITE_DOOR,
+    SPRITE_DOOR_OPEN
+  };
+
+  // Sprite of each mark reason and whether it floats over an actor
+  const struct {
+    const Sprite* sprite;
+    bool overhead;
+  } mark_sprites[] = {
+    [MARK_TILE_PLAYER_ON] = { &sprites[SPRITE_MARK], false },
+    [MARK_TILE_PLAYER_FACING] = { &sprites[SPRITE_DOT], false },
+    [MARK_ACTOR_PATH] = { &sprites[SPRITE_ACTOR_PATH], false },
+    [MARK_ACTOR_SPOTTED] = { &sprites[SPRITE_ACTOR_SPOTTED], true },
+    //[MARK_ACTOR_CHASING] = { &sprites[SPRITE_ACTOR_CHASING], true },
+    [MARK_ACTOR_LOST] = { &sprites[SPRITE_ACTOR_LOST], true },
+  };
+  const int MARK_SPRITE_COUNT = sizeof(mark_sprites) / sizeof(mark_sprites[0]);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+  SpriteBatch batch;
+  init_sprite_batch(&batch, atlas, 1024);
+
+  Camera camera;
+  init_camera(&camera, win_w, win_h);
+
+  Profile profile;
+  init_profile(&profile, profile_csv);
+  bool show_profile = false;
+
   int frame = 0;
 
   const int ACTOR_R = 1500;
 
   Actor player;
-  init_actor(&player, pc(1), pc(1), 0, ACTOR_R);
 
   typedef struct {
     Action action;
@@ -1432,29 +4723,50 @@ int main (int argc, char *argv[]) {
 
   memset(actions, false, ACTION_COUNT * sizeof(bool));
 
-  Uint32 target_ticks = 0;
-  const Uint32 FRAME_TICKS = 1000 / 60;
+  // The game advances in fixed steps however fast frames are drawn. Time
+  // is accumulated as ticks times STEP_RATE, so that each step is exactly
+  // a second's worth of ticks and the rate does not round to 62.5 Hz.
+  static const Uint32 STEP_RATE = 60;         // Steps per second
+  static const Uint32 STEP_COST = 1000;       // Ticks per second
+  static const int MAX_STEPS = 5;             // Per frame, the rest is dropped
+  static const bool INTERPOLATE = true;       // Draw between the last two steps
+  static const int FAST_FORWARD_STEPS = 1000; // Per frame when fast forwarding
+
   Level level;
 
-  load_level("level.lev", &level);
+  load_level(DEMO_LEVEL, &level);
 
-  Actor actors[20];
-  ActorList actor_list = {
-    .len = 0,
-    .max = 20,
-    .actors = actors
-  };
+  TileLayer* tile_layer = new_tile_layer(&level, atlas, tile_sprites);
+
+  ActorList* actors = new_actor_list(20);
+  if (actors == NULL) {
+    return 1;
+  }
 
-  init_actor(&actors[0], pc(15), pc(10), 180, ACTOR_R);
-  ++actor_list.len;
+  Broadphase* broadphase = new_broadphase(level.width, level.height, actors->max + 1);
 
-  for (int i = 0; i < 5; ++i) {
-    init_actor(&actors[i + 1], pc(16), pc(10), 90, ACTOR_R);
-    ++actor_list.len;
+  Ai* ai = new_ai(&level, 0);
+  if (ai == NULL) {
+    return 1;
+  }
+
+  const int sight_radius = 10;
+  Sight* sight = new_sight(sight_radius);
+  FogLayer* fog = new_fog_layer(&level);
+  if (sight == NULL || fog == NULL) {
+    return 1;
   }
 
+  add_demo_actors(&player, actors, ACTOR_R);
+
+  MarkList mark_list;
+  init_mark_list(&mark_list);
+
+  Uint32 last_ticks = SDL_GetTicks();
+  Uint32 accumulator = STEP_COST;
+
   while (running) {
-    if (SDL_PollEvent(&event)) {
+    while (running && SDL_PollEvent(&event)) {
       switch (event.type) {
         case SDL_QUIT:
           running = false;
@@ -1462,11 +4774,14 @@ int main (int argc, char *argv[]) {
 
         case SDL_KEYDOWN:
         case SDL_KEYUP:
+          if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F3) {
+            show_profile = !show_profile;
+          }
           for (int i = 0; i < MAPPING_COUNT; ++i) {
-            if (event.key.keysym.sym == keymap[i].key) {
+            if (event.key.keysym.sym == keymap[i].key && replay_file == NULL) {
               actions[keymap[i].action] = (event.type == SDL_KEYDOWN);
               if (event.type == SDL_KEYDOWN) {
-                fprintf(stderr, "Action %d\n", keymap[i].action);
+                log_d("Action %d", keymap[i].action);
               }
             }
           }
@@ -1482,72 +4797,412 @@ int main (int argc, char *argv[]) {
     /* } */
     /* fprintf(stderr, "\n"); */
 
-    Mark marks[100];
-    MarkList mark_list = { .marks = marks, .len = 0, .max_len = 100 };
+    const Uint32 now = SDL_GetTicks();
+    accumulator += (now - last_ticks) * STEP_RATE;
+    last_ticks = now;
+
+    // Fast forward steps until a frame's worth of time has passed
+    if (fast_forward) {
+      accumulator = FAST_FORWARD_STEPS * STEP_COST;
+    }
+
+    for (int steps = 0; accumulator >= STEP_COST; ++steps) {
+      if (fast_forward ? (SDL_GetTicks() - now) * STEP_RATE >= STEP_COST : steps == MAX_STEPS) {
+        accumulator %= STEP_COST;
+        break;
+      }
+
+      if (replay_file != NULL && !replay_actions(&recording, actions)) {
+        log_d("Replay ended after %d steps", frame);
+        running = false;
+        break;
+      }
+      if (record_file != NULL) {
+        record_actions(&recording, actions);
+      }
+
+      memcpy(actors->prev_x, actors->x, actors->len * sizeof(int));
+      memcpy(actors->prev_y, actors->y, actors->len * sizeof(int));
+      player.prev_x = player.x;
+      player.prev_y = player.y;
+
+      reset_mark_list(&mark_list);
+      game(frame++, &level, &mark_list, &player, actions, actors, broadphase, ai);
+      accumulator -= STEP_COST;
+    }
 
-    game(frame++, &level, &mark_list, &player, actions, actor_list);
+    if (update_sight(sight, &level, &player)) {
+      update_fog_layer(fog, sight);
+    }
 
-    const int sight_radius = 10;
-    Sight* sight = compute_sight(level, player, sight_radius);
+    const double alpha = INTERPOLATE ? (double)accumulator / STEP_COST : 1.0;
 
     glClear(GL_COLOR_BUFFER_BIT);
 
-    glEnable(GL_TEXTURE_2D);
-    draw_level(level, tile_textures, tex_darkness, sight);
+    const int player_x = interpolate(player.prev_x, player.x, alpha);
+    const int player_y = interpolate(player.prev_y, player.y, alpha);
+    camera_follow(&camera, &level, player_x, player_y);
 
-    for (int i = 0; i < actor_list.len; ++i) {
-      const Actor* const actor = &actor_list.actors[i];
-      /* if (sight_get(sight, tc(actor->x), tc(actor->y))) { */
-        draw_texture(tex_actor, actor->x, actor->y, actor->angle, true);
+    glEnable(GL_TEXTURE_2D);
+    glLoadIdentity();
+    glTranslated(-camera.x / (double)COORD_PREC, -camera.y / (double)COORD_PREC, 0);
+    draw_level(tile_layer, &level, &camera, atlas, tile_sprites);
+    draw_fog_layer(fog);
+
+    for (int i = 0; i < actors->len; ++i) {
+      const int x = interpolate(actors->prev_x[i], actors->x[i], alpha);
+      const int y = interpolate(actors->prev_y[i], actors->y[i], alpha);
+      if (!camera_sees(&camera, x, y)) {
+        continue;
+      }
+      /* if (sight_get(sight, tc(actors->x[i]), tc(actors->y[i]))) { */
+        draw_texture(&batch, &sprites[SPRITE_ACTOR], x, y, actors->angle[i]);
       /* } */
     }
 
-    draw_texture(tex_player, player.x, player.y, player.angle, true);
-
-    for (int i = 0; i < mark_list.len; ++i) {
-      const int x = marks[i].x;
-      const int y = marks[i].y;
-      switch (marks[i].reason) {
-        case MARK_TILE_PLAYER_ON:
-          draw_tile(tex_mark, x, y);
-          break;
-        case MARK_TILE_PLAYER_FACING:
-          draw_tile(tex_dot, x, y);
-          break;
-        case MARK_ACTOR_PATH:
-          draw_tile(tex_actor_path, x, y);
-          break;
+    draw_texture(&batch, &sprites[SPRITE_PLAYER], player_x, player_y, player.angle);
 
-        case MARK_ACTOR_SPOTTED:
-          //if (sight_get(sight, tc(x), tc(y))) {
-            draw_texture(tex_actor_spotted, x, y - 0.6 * TILE_SIZE, 0, true);
-          //};
-          break;
+    // Marks go in one pass per reason so that they layer the same way
+    for (int r = 0; r < MARK_SPRITE_COUNT; ++r) {
+      if (mark_sprites[r].sprite == NULL) {
+        continue;
+      }
 
-        /* case MARK_ACTOR_CHASING: */
-        /*   //if (sight_get(sight, tc(x), tc(y))) { */
-        /*     draw_texture(tex_actor_chasing, x, y - 0.6 * TILE_SIZE, 0, true); */
-        /*   //}; */
-        /*   break; */
+      for (int i = 0; i < mark_list.len; ++i) {
+        const Mark* const m = &mark_list.marks[i];
+        if (m->reason != r) {
+          continue;
+        }
 
-        case MARK_ACTOR_LOST:
+        const int x = m->x;
+        const int y = m->y;
+        if (mark_sprites[r].overhead) {
+          if (!camera_sees(&camera, x, y)) {
+            continue;
+          }
           //if (sight_get(sight, tc(x), tc(y))) {
-            draw_texture(tex_actor_lost, x, y - 0.6 * TILE_SIZE, 0, true);
+            draw_texture(&batch, mark_sprites[r].sprite, x, y - 0.6 * TILE_SIZE, 0);
           //};
-          break;
+        }
+        else if (x >= camera.tx1 && x <= camera.tx2 && y >= camera.ty1 && y <= camera.ty2) {
+          draw_tile(&batch, mark_sprites[r].sprite, x, y);
+        }
       }
     }
 
-    free_sight(sight);
+    flush_sprites(&batch);
 
     glDisable(GL_TEXTURE_2D);
-    glEnd();
+
+    if (show_profile) {
+      glLoadIdentity();
+      draw_profile(&profile, 1000.0 / STEP_RATE);
+    }
 
     SDL_GL_SwapBuffers();
+
+    end_profile_frame(&profile);
+    flush_log();
+
+    // Sleep until the next step is due unless vsync already waited
+    const Uint32 elapsed = accumulator + (SDL_GetTicks() - last_ticks) * STEP_RATE;
+    if (!fast_forward && elapsed < STEP_COST) {
+      SDL_Delay((STEP_COST - elapsed + STEP_RATE - 1) / STEP_RATE);
+    }
   }
 
+  if (replay_file != NULL) {
+    stop_replay(&recording);
+  }
+  else if (record_file != NULL) {
+    stop_recording(&recording);
+  }
+
+  free_ai(ai);
+  free_actor_list(actors);
+  free_mark_list(&mark_list);
+  free_fog_layer(fog);
+  free_sight(sight);
+  free_broadphase(broadphase);
+  free_tile_layer(tile_layer);
+  free_sprite_batch(&batch);
+  free_atlas(atlas);
   free_level(level);
 
+  if (profile_csv != NULL) {
+    fclose(profile_csv);
+  }
+
   SDL_Quit();
 }
+#else
+
+
+// Writes a width x height level of square rooms to file. Every wall
+// between rooms has an opening and usually a door too.
+void generate_level (FILE* file, const int width, const int height, unsigned int seed) {
+  static const int ROOM = 10;
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const bool border = x == 0 || y == 0 || x == width - 1 || y == height - 1;
+      const bool wall_x = x % ROOM == 0;
+      const bool wall_y = y % ROOM == 0;
+      char c = ' ';
+      if (border || (wall_x && wall_y)) {
+        c = '#';
+      }
+      else if (wall_x || wall_y) {
+        const int along = (wall_x ? y : x) % ROOM;
+        c = along == ROOM / 2 ? ' ' : along == ROOM / 2 - 2 && rand_r(&seed) % 4 ? '+' : '#';
+      }
+      else if (x % ROOM > 1 && x % ROOM < ROOM - 1 && y % ROOM > 1 && y % ROOM < ROOM - 1 &&
+          rand_r(&seed) % 30 == 0) {
+        c = '#';
+      }
+      fputc(c, file);
+    }
+    fputc('\n', file);
+  }
+}
+
+
+int random_floor (const Level* level, unsigned int* seed) {
+  int i;
+  do {
+    i = rand_r(seed) % (level->width * level->height);
+  }
+  while (!bit_get(level->passable_bits, i));
+  return i;
+}
+
+
+void usage (const char* name) {
+  fprintf(stderr, "Usage: %s [-l level.lev | -g WIDTHxHEIGHT | -i replay.trec] [-n actors] [-f frames] [-s seed] [-j threads] [-p profile.csv] [-o level.levb] [-a alert_frames]\n", name);
+}
+
+
+int main (int argc, char *argv[]) {
+  atexit(flush_log);
+
+  const char* filename = DEMO_LEVEL;
+  int gen_w = 0;
+  int gen_h = 0;
+  int actor_count = 50;
+  int frames = 1000;
+  unsigned int seed = 1;
+  int threads = 0;
+  FILE* profile_csv = NULL;
+  const char* binary_out = NULL;
+  const char* replay_file = NULL;
+  bool frames_set = false;
+  // Idle actors hear the player this often, so there is always someone
+  // chasing or heading back to base. 0 leaves them to their own senses.
+  int alert_frames = 120;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:g:n:f:s:j:p:o:i:a:")) != -1) {
+    switch (opt) {
+      case 'l':
+        filename = optarg;
+        break;
+      case 'g':
+        if (sscanf(optarg, "%dx%d", &gen_w, &gen_h) != 2 || gen_w < 3 || gen_h < 3) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'n':
+        actor_count = atoi(optarg);
+        break;
+      case 'f':
+        frames = atoi(optarg);
+        frames_set = true;
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'o':
+        binary_out = optarg;
+        break;
+      case 'i':
+        replay_file = optarg;
+        break;
+      case 'a':
+        alert_frames = atoi(optarg);
+        break;
+      case 'p':
+        profile_csv = fopen(optarg, "w");
+        if (profile_csv == NULL) {
+          log_e("Could not open %s: %s", optarg, strerror(errno));
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  // A replay runs the game's own scene for as long as the recording lasts,
+  // so it only makes sense on the demo level
+  Recording replay;
+  if (replay_file != NULL) {
+    if (gen_w > 0 || strcmp(filename, DEMO_LEVEL) != 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (!start_replay(&replay, replay_file)) {
+      return 1;
+    }
+    if (!frames_set) {
+      frames = INT_MAX;
+    }
+  }
+
+  Level level;
+  if (gen_w > 0) {
+    FILE* file = tmpfile();
+    if (file == NULL) {
+      log_e("Could not create level file: %s", strerror(errno));
+      return 1;
+    }
+    generate_level(file, gen_w, gen_h, seed);
+    rewind(file);
+    const bool ok = read_level(file, &level);
+    fclose(file);
+    if (!ok) {
+      return 1;
+    }
+  }
+  else if (!load_level(filename, &level)) {
+    return 1;
+  }
+
+  // Precompiles the level instead of running it
+  if (binary_out != NULL) {
+    const bool ok = save_binary_level(binary_out, &level);
+    free_level(level);
+    return ok ? 0 : 1;
+  }
+
+  // Actors are placed on random floor, which has to exist
+  int floor_tiles = 0;
+  for (int i = 0; i < level.width * level.height; ++i) {
+    floor_tiles += bit_get(level.passable_bits, i);
+  }
+  if (floor_tiles == 0) {
+    log_e("Level has no floor to place actors on", 0);
+    free_level(level);
+    return 1;
+  }
+
+  const int ACTOR_R = 1500;
+
+  Actor player;
+  ActorList* actors = new_actor_list(actor_count);
+  Broadphase* broadphase = new_broadphase(level.width, level.height, actor_count + 1);
+  Ai* ai = new_ai(&level, threads);
+
+  MarkList mark_list;
+  init_mark_list(&mark_list);
+
+  if (actors == NULL || broadphase == NULL || ai == NULL) {
+    log_e("Failed to allocate benchmark state: %s", strerror(errno));
+    return 1;
+  }
+
+  if (replay_file != NULL) {
+    add_demo_actors(&player, actors, ACTOR_R);
+    actor_count = actors->len;
+  }
+  else {
+    const int start = random_floor(&level, &seed);
+    init_actor(&player, pc(start % level.width), pc(start / level.width), 0, ACTOR_R);
+
+    for (int i = 0; i < actor_count; ++i) {
+      const int at = random_floor(&level, &seed);
+      add_actor(actors, pc(at % level.width), pc(at / level.width),
+          rand_r(&seed) % 4 * 90, ACTOR_R);
+    }
+  }
+
+  // Scripted input: held keys change a few times a second
+  static const int INPUT_FRAMES = 20;
+
+  bool actions[ACTION_COUNT];
+  memset(actions, false, ACTION_COUNT * sizeof(bool));
+
+  Profile profile;
+  init_profile(&profile, profile_csv);
+
+  const int64_t started = clock_ns();
+
+  int frame = 0;
+  for (; frame < frames; ++frame) {
+    if (replay_file != NULL) {
+      if (!replay_actions(&replay, actions)) {
+        break;
+      }
+    }
+    else if (frame % INPUT_FRAMES == 0) {
+      actions[FORWARD] = rand_r(&seed) % 100 < 70;
+      actions[LEFT] = rand_r(&seed) % 100 < 25;
+      actions[RIGHT] = !actions[LEFT] && rand_r(&seed) % 100 < 25;
+      actions[ACTIVATE] = rand_r(&seed) % 100 < 30;
+    }
+
+    if (replay_file == NULL && alert_frames > 0 && frame % alert_frames == 0) {
+      for (int i = 0; i < actors->len; ++i) {
+        ActorMind* const actor = &actors->minds[i];
+        if (!has_target(actor)) {
+          actor->tx = player.x;
+          actor->ty = player.y;
+        }
+      }
+    }
+
+    reset_mark_list(&mark_list);
+    game(frame, &level, &mark_list, &player, actions, actors, broadphase, ai);
+
+    end_profile_frame(&profile);
+    flush_log();
+  }
+
+  const double total_ms = (clock_ns() - started) / 1e6;
+
+  if (replay_file != NULL) {
+    stop_replay(&replay);
+    frames = frame;
+  }
 
+  printf("level %d x %d, %d actors, %d frames, %d threads\n",
+      level.width, level.height, actor_count, frames, ai->pool->count);
+  printf("%-10s %10.2f ms %8.3f ms/frame %8.1f fps\n", "total",
+      total_ms, total_ms / frames, frames / (total_ms / 1000));
+  for (int t = 0; t < TIMER_COUNT; ++t) {
+    const double ms = timers[t].ns / 1e6;
+    printf("%-10s %10.2f ms %8.3f ms/frame %8.1f %% %10d calls\n", TIMER_NAMES[t],
+        ms, ms / frames, 100 * ms / total_ms, timers[t].calls);
+  }
+  for (int c = 0; c < COUNTER_COUNT; ++c) {
+    printf("%-20s %12lld %12.1f /frame\n", COUNTER_NAMES[c],
+        (long long)counters[c], (double)counters[c] / frames);
+  }
+
+  free_ai(ai);
+  free_actor_list(actors);
+  free_mark_list(&mark_list);
+  free_broadphase(broadphase);
+  free_level(level);
+
+  if (profile_csv != NULL) {
+    fclose(profile_csv);
+  }
+
+  return 0;
+}
+#endif